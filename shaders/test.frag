@@ -1,9 +1,11 @@
 #version 450
 
+layout(constant_id = 1) const float alpha_scale = 1.0;
+
 layout(location = 0) in vec4 frag_color;
 
 layout(location = 0) out vec4 out_color;
 
 void main() {
-    out_color = frag_color;
+    out_color = vec4(frag_color.rgb, frag_color.a * alpha_scale);
 }
\ No newline at end of file
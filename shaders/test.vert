@@ -1,11 +1,49 @@
 #version 450
 
+layout(constant_id = 0) const float point_size = 1.0;
+// Positions are 16 bit unorm steps across the object's box, see PositionFormat::eQuantized16
+layout(constant_id = 2) const bool quantized_position = false;
+// Colors come from the object instead of in_color, see ColorFormat::eObject
+layout(constant_id = 3) const bool object_color = false;
+
 layout(location = 0) in vec4 in_position;
 layout(location = 1) in vec4 in_color;
 
 layout(location = 0) out vec4 fragment_color;
 
+struct ObjectData {
+    vec4 color;
+    vec4 origin;
+    vec4 extent;
+};
+
+layout(set = 0, binding = 0) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    mat4 view_projection;
+};
+
+// Indexed by the draw's first instance, which is the object's slot
+layout(std430, set = 0, binding = 1) readonly buffer Objects {
+    ObjectData objects[];
+};
+
+// Object space to world space, by slot like objects
+layout(std430, set = 0, binding = 2) readonly buffer Transforms {
+    mat4 models[];
+};
+
 void main() {
-    gl_Position = in_position;
-    fragment_color = in_color;
+    vec3 position = in_position.xyz;
+    if(quantized_position || object_color) {
+        ObjectData object = objects[gl_InstanceIndex];
+        if(quantized_position) {
+            position = object.origin.xyz + position * object.extent.xyz;
+        }
+        fragment_color = object_color ? object.color : in_color;
+    } else {
+        fragment_color = in_color;
+    }
+    gl_Position = view_projection * models[gl_InstanceIndex] * vec4(position, 1.0);
+    gl_PointSize = point_size;
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+#include "allocator.h"
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+const vk::DeviceSize default_block_size = 64 * 1024 * 1024;
+
+DeviceAllocator::DeviceAllocator(vk::PhysicalDevice physical_device, vk::Device device, bool memory_budget_supported)
+    : physical_device(physical_device), device(device), memory_budget_supported(memory_budget_supported) {
+    mem_props = physical_device.getMemoryProperties();
+    max_allocation_count = physical_device.getProperties().limits.maxMemoryAllocationCount;
+
+    heap_allocated.resize(mem_props.memoryHeapCount, 0);
+    heap_used.resize(mem_props.memoryHeapCount, 0);
+}
+
+Allocation DeviceAllocator::allocate(const vk::MemoryRequirements& reqs, vk::MemoryPropertyFlags flags, bool linear) {
+    uint32_t memory_type = find_memory_type(reqs.memoryTypeBits, flags);
+    if(memory_type == std::numeric_limits<uint32_t>::max()) {
+        std::cerr << "Memory type not found\n";
+        std::exit(EXIT_FAILURE);
+    }
+    uint32_t heap = mem_props.memoryTypes[memory_type].heapIndex;
+
+    Allocation allocation {};
+    allocation.size = reqs.size;
+    allocation.memory_type = memory_type;
+
+    // Large resources get their own allocation instead of wasting most of a block
+    vk::DeviceSize block_bytes = block_size(memory_type);
+    if(reqs.size > block_bytes / 2) {
+        allocation.memory = allocate_device_memory(reqs.size, memory_type, &allocation.mapped);
+        heap_used[heap] += reqs.size;
+        return allocation;
+    }
+
+    for(uint32_t i = 0; i != blocks.size(); ++i) {
+        Block& block = blocks[i];
+        if(block.memory_type != memory_type || block.linear != linear) {
+            continue;
+        }
+
+        uint64_t offset = block.ranges.allocate(reqs.size, reqs.alignment);
+        if(offset != RangeAllocator::invalid_offset) {
+            allocation.memory = block.memory;
+            allocation.offset = offset;
+            allocation.mapped = block.mapped ? block.mapped + offset : nullptr;
+            allocation.block = i;
+            heap_used[heap] += reqs.size;
+            return allocation;
+        }
+    }
+
+    Block block {};
+    block.size = block_bytes;
+    block.memory_type = memory_type;
+    block.linear = linear;
+    block.memory = allocate_device_memory(block_bytes, memory_type, &block.mapped);
+    block.ranges.grow(block_bytes);
+
+    allocation.memory = block.memory;
+    allocation.offset = block.ranges.allocate(reqs.size, reqs.alignment);
+    allocation.mapped = block.mapped ? block.mapped + allocation.offset : nullptr;
+    allocation.block = blocks.size();
+    heap_used[heap] += reqs.size;
+
+    blocks.push_back(std::move(block));
+    return allocation;
+}
+
+Allocation DeviceAllocator::allocate_buffer(vk::Buffer buffer, vk::MemoryPropertyFlags flags) {
+    Allocation allocation = allocate(device.getBufferMemoryRequirements(buffer), flags, true);
+    device.bindBufferMemory(buffer, allocation.memory, allocation.offset);
+    return allocation;
+}
+
+Allocation DeviceAllocator::allocate_image(vk::Image image, vk::MemoryPropertyFlags flags, bool linear) {
+    Allocation allocation = allocate(device.getImageMemoryRequirements(image), flags, linear);
+    device.bindImageMemory(image, allocation.memory, allocation.offset);
+    return allocation;
+}
+
+void DeviceAllocator::free(Allocation& allocation) {
+    if(!allocation.memory) {
+        return;
+    }
+
+    uint32_t heap = mem_props.memoryTypes[allocation.memory_type].heapIndex;
+    heap_used[heap] -= allocation.size;
+    if(allocation.block == ~0u) {
+        device.freeMemory(allocation.memory);
+        heap_allocated[heap] -= allocation.size;
+        --device_allocation_count;
+    } else {
+        blocks[allocation.block].ranges.free(allocation.offset);
+    }
+
+    allocation = Allocation {};
+}
+
+void DeviceAllocator::destroy() {
+    for(auto& block : blocks) {
+        device.freeMemory(block.memory);
+    }
+    blocks.clear();
+    device_allocation_count = 0;
+}
+
+bool DeviceAllocator::has_memory_type(vk::MemoryPropertyFlags flags) const {
+    return find_memory_type(~0u, flags) != std::numeric_limits<uint32_t>::max();
+}
+
+void DeviceAllocator::print_stats() {
+    vk::PhysicalDeviceMemoryBudgetPropertiesEXT budget {};
+    if(memory_budget_supported) {
+        vk::PhysicalDeviceMemoryProperties2 props2 {};
+        props2.pNext = &budget;
+        physical_device.getMemoryProperties2(&props2);
+    }
+
+    std::cout << "Device memory: " << device_allocation_count << " / " << max_allocation_count << " allocations, "
+              << blocks.size() << " blocks\n";
+    for(uint32_t heap = 0; heap != mem_props.memoryHeapCount; ++heap) {
+        std::cout << "  Heap " << heap << ": " << heap_used[heap] << " bytes used, "
+                  << heap_allocated[heap] << " bytes allocated";
+        if(memory_budget_supported) {
+            std::cout << ", process usage " << budget.heapUsage[heap] << " of budget " << budget.heapBudget[heap];
+        } else {
+            std::cout << ", heap size " << mem_props.memoryHeaps[heap].size;
+        }
+        std::cout << "\n";
+    }
+    for(uint32_t i = 0; i != blocks.size(); ++i) {
+        std::cout << "  Block " << i << " (type " << blocks[i].memory_type << (blocks[i].linear ? ", linear" : ", optimal") << "): "
+                  << blocks[i].ranges.used() << " / " << blocks[i].size << " bytes, fragmentation "
+                  << blocks[i].ranges.fragmentation() << "\n";
+    }
+}
+
+uint32_t DeviceAllocator::find_memory_type(uint32_t type_bits, vk::MemoryPropertyFlags flags) const {
+    for(uint32_t i = 0; i != mem_props.memoryTypeCount; ++i) {
+        if((type_bits & (1u << i)) && (mem_props.memoryTypes[i].propertyFlags & flags) == flags) {
+            return i;
+        }
+    }
+
+    return std::numeric_limits<uint32_t>::max();
+}
+
+// Small heaps, such as the 256 MiB host visible window on discrete GPUs, get smaller blocks
+vk::DeviceSize DeviceAllocator::block_size(uint32_t memory_type) const {
+    vk::DeviceSize heap_size = mem_props.memoryHeaps[mem_props.memoryTypes[memory_type].heapIndex].size;
+    return std::min(default_block_size, heap_size / 8);
+}
+
+vk::DeviceMemory DeviceAllocator::allocate_device_memory(vk::DeviceSize size, uint32_t memory_type, char** mapped) {
+    if(device_allocation_count >= max_allocation_count) {
+        std::cerr << "Exceeded maxMemoryAllocationCount\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    vk::DeviceMemory memory = device.allocateMemory(vk::MemoryAllocateInfo(size, memory_type));
+    ++device_allocation_count;
+    heap_allocated[mem_props.memoryTypes[memory_type].heapIndex] += size;
+
+    // Host visible memory stays mapped for as long as it is allocated
+    if(mem_props.memoryTypes[memory_type].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) {
+        *mapped = static_cast<char*>(device.mapMemory(memory, 0, size));
+    }
+    return memory;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "arena.h"
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+struct Allocation {
+    vk::DeviceMemory memory {};
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    char* mapped = nullptr; // Points at offset, only set for host visible memory
+    uint32_t memory_type = 0;
+    uint32_t block = ~0u; // Index into the allocator's blocks, ~0u for dedicated allocations
+};
+
+// Suballocates buffers and images from large per memory type blocks, so the number of
+// vkAllocateMemory calls stays far below maxMemoryAllocationCount.
+// Linear (buffers, linear images) and optimal resources never share a block,
+// which keeps bufferImageGranularity from ever applying between neighbours.
+class DeviceAllocator {
+public:
+    DeviceAllocator() = default;
+    DeviceAllocator(vk::PhysicalDevice physical_device, vk::Device device, bool memory_budget_supported);
+
+    // Host visible memory is persistently mapped and requires eHostCoherent to be requested
+    Allocation allocate(const vk::MemoryRequirements& reqs, vk::MemoryPropertyFlags flags, bool linear);
+    Allocation allocate_buffer(vk::Buffer buffer, vk::MemoryPropertyFlags flags);
+    Allocation allocate_image(vk::Image image, vk::MemoryPropertyFlags flags, bool linear);
+    void free(Allocation& allocation);
+    void destroy();
+
+    bool has_memory_type(vk::MemoryPropertyFlags flags) const;
+    const vk::PhysicalDeviceMemoryProperties& memory_properties() const { return mem_props; }
+    void print_stats();
+
+private:
+    struct Block {
+        vk::DeviceMemory memory {};
+        vk::DeviceSize size = 0;
+        uint32_t memory_type = 0;
+        bool linear = true;
+        char* mapped = nullptr;
+        RangeAllocator ranges;
+    };
+
+    vk::PhysicalDevice physical_device {};
+    vk::Device device {};
+    bool memory_budget_supported = false;
+    vk::PhysicalDeviceMemoryProperties mem_props {};
+    uint32_t max_allocation_count = 0;
+
+    std::vector<Block> blocks;
+    uint32_t device_allocation_count = 0; // Live vkAllocateMemory allocations, blocks and dedicated
+    std::vector<vk::DeviceSize> heap_allocated; // Bytes allocated from the driver, per heap
+    std::vector<vk::DeviceSize> heap_used; // Bytes handed out to resources, per heap
+
+    uint32_t find_memory_type(uint32_t type_bits, vk::MemoryPropertyFlags flags) const;
+    vk::DeviceSize block_size(uint32_t memory_type) const;
+    vk::DeviceMemory allocate_device_memory(vk::DeviceSize size, uint32_t memory_type, char** mapped);
+};
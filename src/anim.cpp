@@ -0,0 +1,358 @@
+#include "anim.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ANIM_X86 1
+#include <immintrin.h>
+#endif
+
+// Tracks per job, small tracks take well under a microsecond each
+const size_t track_grain = 2048;
+const size_t pose_grain = 1024;
+
+// Keys, tangents and outputs are stored this many floats apart, padded with zeros so blend_keys runs whole
+// SIMD vectors for widths 3 and 4, the common ones
+uint32_t padded_width(uint32_t width) {
+    return (width + 3) & ~3u;
+}
+
+// Appends the width floats at values, then zeros up to the padded width
+void append_padded(std::vector<float>& pool, const float* values, uint32_t width) {
+    pool.insert(pool.end(), values, values + width);
+    pool.insert(pool.end(), padded_width(width) - width, 0.0f);
+}
+
+// out = w[0] * p0 + w[1] * m0 + w[2] * p1 + w[3] * m1, the tangent terms only when m0 is not null
+void blend_keys(const float* p0, const float* p1, const float* m0, const float* m1, const float w[4], uint32_t n, float* out) {
+    uint32_t i = 0;
+#ifdef ANIM_X86
+    __m128 w0 = _mm_set1_ps(w[0]), w1 = _mm_set1_ps(w[1]), w2 = _mm_set1_ps(w[2]), w3 = _mm_set1_ps(w[3]);
+    if(m0) {
+        for(; i + 4 <= n; i += 4) {
+            __m128 v = _mm_add_ps(_mm_mul_ps(w0, _mm_loadu_ps(p0 + i)), _mm_mul_ps(w2, _mm_loadu_ps(p1 + i)));
+            v = _mm_add_ps(v, _mm_add_ps(_mm_mul_ps(w1, _mm_loadu_ps(m0 + i)), _mm_mul_ps(w3, _mm_loadu_ps(m1 + i))));
+            _mm_storeu_ps(out + i, v);
+        }
+    } else {
+        for(; i + 4 <= n; i += 4) {
+            _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(w0, _mm_loadu_ps(p0 + i)), _mm_mul_ps(w2, _mm_loadu_ps(p1 + i))));
+        }
+    }
+#endif
+    for(; i != n; ++i) {
+        out[i] = w[0] * p0[i] + w[2] * p1[i] + (m0 ? w[1] * m0[i] + w[3] * m1[i] : 0.0f);
+    }
+}
+
+float ease(Interpolation interpolation, float u) {
+    switch(interpolation) {
+        case Interpolation::eEaseIn:
+            return u * u;
+        case Interpolation::eEaseOut:
+            return u * (2.0f - u);
+        case Interpolation::eEaseInOut:
+            return u * u * (3.0f - 2.0f * u);
+        default:
+            return u;
+    }
+}
+
+uint32_t target_width(TrackTarget target) {
+    switch(target) {
+        case TrackTarget::eTranslation:
+        case TrackTarget::eScale:
+            return 3;
+        case TrackTarget::eRotation:
+        case TrackTarget::eColor:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+Animator::Animator(double step) : step(step) {}
+
+uint32_t Animator::add(const Track& track) {
+    uint32_t n = track.width != 0 ? track.width : target_width(track.target);
+    uint32_t keys = track.times.size();
+    if(n == 0 || keys == 0 || track.values.size() != size_t(keys) * n) {
+        std::cerr << "Animation track needs at least one key and width values per key, got " << keys << " keys and "
+            << track.values.size() << " values of width " << n << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if(!std::is_sorted(track.times.begin(), track.times.end())) {
+        std::cerr << "Animation track key times are not ascending\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if(track.target == TrackTarget::eVertices && n % 3 != 0) {
+        std::cerr << "Vertex animation tracks need 3 values per vertex, got width " << n << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if(!track.tangents.empty() && track.tangents.size() != track.values.size()) {
+        std::cerr << "Animation track has " << track.tangents.size() << " tangents for " << track.values.size() << " values\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    uint32_t index = key_first.size();
+    key_first.push_back(key_times.size());
+    key_count.push_back(keys);
+    value_first.push_back(key_values.size());
+    output_first.push_back(output.size());
+    width.push_back(n);
+    cursor.push_back(0);
+    interpolation.push_back(track.interpolation);
+    target.push_back(track.target);
+    object.push_back(track.object);
+    first_vertex.push_back(track.first_vertex);
+    loop.push_back(track.loop);
+    active.push_back(1);
+    held.push_back(0);
+    changed.push_back(0);
+    evaluated_steps = ~0ull;
+
+    key_times.insert(key_times.end(), track.times.begin(), track.times.end());
+    for(uint32_t k = 0; k != keys; ++k) {
+        append_padded(key_values, track.values.data() + k * n, n);
+    }
+    append_padded(output, track.values.data(), n);
+
+    if(track.interpolation != Interpolation::eHermite) {
+        tangent_first.push_back(~0u);
+    } else if(!track.tangents.empty()) {
+        tangent_first.push_back(key_tangents.size());
+        for(uint32_t k = 0; k != keys; ++k) {
+            append_padded(key_tangents, track.tangents.data() + k * n, n);
+        }
+    } else {
+        // Catmull-Rom, the slope between the neighbouring keys, one sided at the ends
+        tangent_first.push_back(key_tangents.size());
+        for(uint32_t k = 0; k != keys; ++k) {
+            uint32_t before = k == 0 ? 0 : k - 1;
+            uint32_t after = k + 1 == keys ? k : k + 1;
+            float dt = track.times[after] - track.times[before];
+            for(uint32_t c = 0; c != n; ++c) {
+                float dv = track.values[after * n + c] - track.values[before * n + c];
+                key_tangents.push_back(dt > 0.0f ? dv / dt : 0.0f);
+            }
+            key_tangents.insert(key_tangents.end(), padded_width(n) - n, 0.0f);
+        }
+    }
+
+    if(track.target == TrackTarget::eTranslation || track.target == TrackTarget::eRotation || track.target == TrackTarget::eScale) {
+        auto& pose_of = track.node != no_scene_node ? pose_of_node : pose_of_object;
+        uint32_t key = track.node != no_scene_node ? track.node : track.object.index;
+        auto it = pose_of.find(key);
+        if(it == pose_of.end()) {
+            it = pose_of.emplace(key, poses.object.size()).first;
+            poses.object.push_back(track.object);
+            poses.node.push_back(track.node);
+            poses.translation.push_back(~0u);
+            poses.rotation.push_back(~0u);
+            poses.scale.push_back(~0u);
+            poses.model.push_back(glm::mat4(1.0f));
+            poses.changed.push_back(0);
+        }
+        uint32_t pose = it->second;
+        if(track.target == TrackTarget::eTranslation) {
+            poses.translation[pose] = index;
+        } else if(track.target == TrackTarget::eRotation) {
+            poses.rotation[pose] = index;
+        } else {
+            poses.scale[pose] = index;
+        }
+    }
+    return index;
+}
+
+void Animator::set_active(uint32_t track, bool is_active) {
+    active[track] = is_active;
+    // Reapplied on the next evaluate even if it is holding a key
+    held[track] = 0;
+    evaluated_steps = ~0ull;
+}
+
+bool Animator::running() const {
+    for(size_t i = 0; i != active.size(); ++i) {
+        if(active[i] && held[i] == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Animator::advance(double seconds) {
+    accumulator += seconds;
+    uint64_t whole = static_cast<uint64_t>(accumulator / step);
+    steps += whole;
+    accumulator -= whole * step;
+}
+
+void Animator::evaluate(JobSystem& jobs) {
+    // Nothing moves between clock steps
+    if(steps == evaluated_steps) {
+        std::fill(changed.begin(), changed.end(), 0);
+        std::fill(poses.changed.begin(), poses.changed.end(), 0);
+        return;
+    }
+    evaluated_steps = steps;
+
+    float t = static_cast<float>(time());
+    JobHandle tracks = jobs.parallel_for(0, track_count(), track_grain, [this, t](size_t first, size_t last) {
+        evaluate_tracks(first, last, t);
+    });
+    JobHandle composed = jobs.parallel_for(0, poses.object.size(), pose_grain, [this](size_t first, size_t last) {
+        compose_poses(first, last);
+    }, {tracks});
+    jobs.wait(composed);
+}
+
+void Animator::evaluate_tracks(size_t first, size_t last, float t) {
+    for(size_t i = first; i != last; ++i) {
+        changed[i] = 0;
+        if(!active[i]) {
+            continue;
+        }
+        const float* times = key_times.data() + key_first[i];
+        uint32_t keys = key_count[i];
+        uint32_t n = padded_width(width[i]);
+        float* out = output.data() + output_first[i];
+        const float* values = key_values.data() + value_first[i];
+
+        float local = t;
+        float start = times[0], end = times[keys - 1];
+        if(loop[i] && end > start) {
+            local = start + std::fmod(t - start, end - start);
+            if(local < start) {
+                local += end - start;
+            }
+        }
+        // A track holding the same key as last time has nothing new to apply
+        uint8_t hold = keys == 1 || local <= start ? 1 : local >= end ? 2 : 0;
+        if(hold != 0) {
+            if(held[i] != hold) {
+                const float* key = hold == 1 ? values : values + (keys - 1) * n;
+                std::copy(key, key + n, out);
+                held[i] = hold;
+                changed[i] = 1;
+            }
+            continue;
+        }
+        held[i] = 0;
+        changed[i] = 1;
+
+        // Segment [k, k + 1] holding local, walked forward from the last one unless time went back
+        uint32_t k = cursor[i];
+        if(k + 1 >= keys || times[k] > local) {
+            k = std::upper_bound(times, times + keys, local) - times - 1;
+        }
+        while(times[k + 1] <= local) {
+            ++k;
+        }
+        cursor[i] = k;
+
+        float dt = times[k + 1] - times[k];
+        float u = (local - times[k]) / dt;
+        float w[4];
+        const float* m0 = nullptr;
+        const float* m1 = nullptr;
+        if(interpolation[i] == Interpolation::eHermite) {
+            float u2 = u * u, u3 = u2 * u;
+            w[0] = 2.0f * u3 - 3.0f * u2 + 1.0f;
+            w[1] = (u3 - 2.0f * u2 + u) * dt;
+            w[2] = -2.0f * u3 + 3.0f * u2;
+            w[3] = (u3 - u2) * dt;
+            m0 = key_tangents.data() + tangent_first[i] + k * n;
+            m1 = m0 + n;
+        } else {
+            float e = ease(interpolation[i], u);
+            w[0] = 1.0f - e;
+            w[1] = 0.0f;
+            w[2] = e;
+            w[3] = 0.0f;
+        }
+        blend_keys(values + k * n, values + (k + 1) * n, m0, m1, w, n, out);
+    }
+}
+
+// model = translation * rotation * scale
+void Animator::compose_poses(size_t first, size_t last) {
+    auto track_changed = [this](uint32_t track) {
+        return track != ~0u && changed[track];
+    };
+    for(size_t p = first; p != last; ++p) {
+        poses.changed[p] = track_changed(poses.translation[p]) || track_changed(poses.rotation[p]) || track_changed(poses.scale[p]);
+        if(!poses.changed[p]) {
+            continue;
+        }
+        glm::vec3 translation(0.0f), scale(1.0f);
+        float x = 0.0f, y = 0.0f, z = 0.0f, w = 1.0f;
+        if(poses.translation[p] != ~0u) {
+            const float* v = values(poses.translation[p]);
+            translation = glm::vec3(v[0], v[1], v[2]);
+        }
+        if(poses.scale[p] != ~0u) {
+            const float* v = values(poses.scale[p]);
+            scale = glm::vec3(v[0], v[1], v[2]);
+        }
+        if(poses.rotation[p] != ~0u) {
+            const float* v = values(poses.rotation[p]);
+            // Interpolated quaternions are shorter than unit length between keys
+            float length = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2] + v[3] * v[3]);
+            if(length > 0.0f) {
+                x = v[0] / length;
+                y = v[1] / length;
+                z = v[2] / length;
+                w = v[3] / length;
+            }
+        }
+
+        glm::mat4& m = poses.model[p];
+        m[0] = glm::vec4(1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y + w * z), 2.0f * (x * z - w * y), 0.0f) * scale.x;
+        m[1] = glm::vec4(2.0f * (x * y - w * z), 1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z + w * x), 0.0f) * scale.y;
+        m[2] = glm::vec4(2.0f * (x * z + w * y), 2.0f * (y * z - w * x), 1.0f - 2.0f * (x * x + y * y), 0.0f) * scale.z;
+        m[3] = glm::vec4(translation, 1.0f);
+    }
+}
+
+// Render is not thread safe, so this part is serial, it only copies what evaluate computed and what changed.
+// A scene where every track holds its last key leaves Render alone, so on demand rendering goes idle.
+void Animator::apply(Render& render, SceneGraph* scene) {
+    for(size_t p = 0; p != poses.object.size(); ++p) {
+        if(!poses.changed[p]) {
+            continue;
+        }
+        if(poses.node[p] == no_scene_node) {
+            render.set_transform(poses.object[p], poses.model[p]);
+        } else if(scene) {
+            scene->set_local(poses.node[p], poses.model[p]);
+        } else {
+            std::cerr << "Animation track targets scene node " << poses.node[p] << " but no scene was given\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    for(size_t i = 0; i != track_count(); ++i) {
+        if(!changed[i]) {
+            continue;
+        }
+        const float* v = values(i);
+        if(target[i] == TrackTarget::eColor) {
+            render.set_color(object[i], glm::vec4(v[0], v[1], v[2], v[3]));
+        } else if(target[i] == TrackTarget::eVertices) {
+            uint32_t count = width[i] / 3;
+            Vertex* vertices = render.edit_vertices(object[i], first_vertex[i], count);
+            for(uint32_t j = 0; j != count; ++j) {
+                vertices[j].position = glm::vec4(v[3 * j], v[3 * j + 1], v[3 * j + 2], 1.0f);
+            }
+        }
+    }
+}
+
+void Animator::update(Render& render, double seconds, SceneGraph* scene) {
+    advance(seconds);
+    evaluate();
+    apply(render, scene);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "render.h"
+#include "scene.h"
+#include "jobs.h"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Animation clock step, evaluation times are always whole multiples of it
+const double default_animation_step = 1.0 / 120.0;
+
+enum class Interpolation : uint8_t {
+    eLinear,
+    eHermite,  // Cubic, through each key with the key's tangent, Catmull-Rom tangents when none are given
+    eEaseIn,   // Linear between keys, slow out of the first key of each pair
+    eEaseOut,  // Slow into the second key
+    eEaseInOut // Slow at both
+};
+
+enum class TrackTarget : uint8_t {
+    eTranslation, // 3 values
+    eRotation,    // 4, a quaternion xyzw, normalized after interpolation
+    eScale,       // 3
+    eColor,       // 4, only shows on objects stored with ColorFormat::eObject
+    eVertices,    // 3 per vertex, positions of vertices [first_vertex, first_vertex + width / 3) of a dynamic object
+    eValues       // Any width, not applied to anything, read back with Animator::values, e.g. spline control points
+};
+
+struct Track {
+    ObjectHandle object;
+    SceneNode node = no_scene_node; // Transform tracks set this node's local matrix instead of the object's transform
+    TrackTarget target = TrackTarget::eValues;
+    Interpolation interpolation = Interpolation::eLinear;
+    uint32_t width = 0; // Values per key, implied by the target except for eVertices and eValues
+    uint32_t first_vertex = 0;
+    bool loop = false; // Starts over after the last key instead of holding it
+    std::vector<float> times; // Ascending, in seconds
+    std::vector<float> values; // times.size() * width, key by key
+    std::vector<float> tangents; // Like values, in value units per second. Only used by eHermite, may be empty.
+};
+
+// Keyframe tracks evaluated in one batch per frame. Tracks are not objects but rows of flat arrays: the keys of
+// every track share one pool, their per track state sits in parallel vectors, and evaluation is a parallel loop
+// over those rows that blends the two surrounding keys with SIMD, so there is no per object call to dispatch.
+// Results go to Render as transforms, object colors and dynamic vertex positions, or to scene nodes.
+class Animator {
+public:
+    explicit Animator(double step = default_animation_step);
+
+    // Returns the track's index. Tracks are never removed, deactivate them before removing their object.
+    uint32_t add(const Track& track);
+    void set_active(uint32_t track, bool active);
+    // The latest values of the track, width floats
+    const float* values(uint32_t track) const { return output.data() + output_first[track]; }
+
+    // Moves the clock forward by whole steps, the remainder carries over to the next call
+    void advance(double seconds);
+    double time() const { return steps * step; }
+    // Only tracks whose output changes are written and later applied
+    void evaluate(JobSystem& jobs = job_system());
+    // Transform tracks with a node need scene
+    void apply(Render& render, SceneGraph* scene = nullptr);
+    // advance, evaluate and apply
+    void update(Render& render, double seconds, SceneGraph* scene = nullptr);
+
+    size_t track_count() const { return key_first.size(); }
+    // An active track is between keys, or not evaluated yet, so later steps still change something. On demand
+    // rendering has to keep requesting frames while this holds, a frame shorter than a step may change nothing.
+    bool running() const;
+
+private:
+    double step;
+    uint64_t steps = 0;
+    double accumulator = 0.0;
+    uint64_t evaluated_steps = ~0ull;
+
+    // Per track
+    std::vector<uint32_t> key_first;   // Into key_times
+    std::vector<uint32_t> key_count;
+    std::vector<uint32_t> value_first; // Key k of the track starts at value_first + k * padded width in key_values
+    std::vector<uint32_t> tangent_first; // Same for key_tangents, ~0u without tangents
+    std::vector<uint32_t> output_first;
+    std::vector<uint32_t> width;
+    std::vector<uint32_t> cursor; // Key the last evaluation started from, time mostly moves forward
+    std::vector<Interpolation> interpolation;
+    std::vector<TrackTarget> target;
+    std::vector<ObjectHandle> object;
+    std::vector<uint32_t> first_vertex;
+    std::vector<uint8_t> loop;
+    std::vector<uint8_t> active;
+    std::vector<uint8_t> held;    // 1 while holding the first key, 2 the last, 0 between keys
+    std::vector<uint8_t> changed; // Output written by the last evaluate
+
+    std::vector<float> key_times;
+    std::vector<float> key_values;
+    std::vector<float> key_tangents;
+    std::vector<float> output;
+
+    // Objects or nodes with transform tracks, composed from the latest outputs of up to three tracks each
+    struct Poses {
+        std::vector<ObjectHandle> object;
+        std::vector<SceneNode> node;
+        std::vector<uint32_t> translation; // Track index, ~0u for none
+        std::vector<uint32_t> rotation;
+        std::vector<uint32_t> scale;
+        std::vector<glm::mat4> model;
+        std::vector<uint8_t> changed;
+    } poses;
+    std::unordered_map<uint32_t, uint32_t> pose_of_object; // By ObjectHandle::index
+    std::unordered_map<SceneNode, uint32_t> pose_of_node;
+
+    void evaluate_tracks(size_t first, size_t last, float t);
+    void compose_poses(size_t first, size_t last);
+};
@@ -0,0 +1,134 @@
+#include "arena.h"
+#include <algorithm>
+#include <iterator>
+
+RangeAllocator::RangeAllocator(uint64_t size) {
+    grow(size);
+}
+
+uint64_t RangeAllocator::allocate(uint64_t alloc_size, uint64_t alignment) {
+    if(alloc_size == 0) {
+        return invalid_offset;
+    }
+    if(alignment == 0) {
+        alignment = 1;
+    }
+
+    for(auto it = free_by_size.lower_bound(alloc_size); it != free_by_size.end(); ++it) {
+        uint64_t range_offset = it->second;
+        uint64_t range_size = it->first;
+        uint64_t aligned = (range_offset + alignment - 1) / alignment * alignment;
+        uint64_t padding = aligned - range_offset;
+        if(padding + alloc_size > range_size) {
+            continue;
+        }
+
+        erase_free_range(free_ranges.find(range_offset));
+        if(padding != 0) {
+            insert_free_range(range_offset, padding);
+        }
+        if(padding + alloc_size != range_size) {
+            insert_free_range(aligned + alloc_size, range_size - padding - alloc_size);
+        }
+
+        allocations[aligned] = alloc_size;
+        used_bytes += alloc_size;
+        return aligned;
+    }
+
+    return invalid_offset;
+}
+
+void RangeAllocator::free(uint64_t offset) {
+    auto allocation = allocations.find(offset);
+    if(allocation == allocations.end()) {
+        return;
+    }
+    uint64_t range_size = allocation->second;
+    used_bytes -= range_size;
+    allocations.erase(allocation);
+
+    // Merge with the free ranges directly before and after
+    auto next = free_ranges.lower_bound(offset);
+    if(next != free_ranges.begin()) {
+        auto prev = std::prev(next);
+        if(prev->first + prev->second == offset) {
+            offset = prev->first;
+            range_size += prev->second;
+            erase_free_range(prev);
+        }
+    }
+    if(next != free_ranges.end() && offset + range_size == next->first) {
+        range_size += next->second;
+        erase_free_range(next);
+    }
+
+    insert_free_range(offset, range_size);
+}
+
+void RangeAllocator::grow(uint64_t new_size) {
+    if(new_size <= size) {
+        return;
+    }
+
+    uint64_t offset = size;
+    uint64_t range_size = new_size - size;
+    if(!free_ranges.empty()) {
+        auto last = std::prev(free_ranges.end());
+        if(last->first + last->second == size) {
+            offset = last->first;
+            range_size += last->second;
+            erase_free_range(last);
+        }
+    }
+
+    insert_free_range(offset, range_size);
+    size = new_size;
+}
+
+uint64_t RangeAllocator::largest_free_range() const {
+    return free_by_size.empty() ? 0 : std::prev(free_by_size.end())->first;
+}
+
+float RangeAllocator::fragmentation() const {
+    uint64_t free_bytes = size - used_bytes;
+    if(free_bytes == 0) {
+        return 0.0f;
+    }
+    return 1.0f - static_cast<float>(largest_free_range()) / static_cast<float>(free_bytes);
+}
+
+void RangeAllocator::insert_free_range(uint64_t offset, uint64_t range_size) {
+    free_ranges[offset] = range_size;
+    free_by_size.emplace(range_size, offset);
+}
+
+void RangeAllocator::erase_free_range(std::map<uint64_t, uint64_t>::iterator it) {
+    auto sizes = free_by_size.equal_range(it->second);
+    for(auto s = sizes.first; s != sizes.second; ++s) {
+        if(s->second == it->first) {
+            free_by_size.erase(s);
+            break;
+        }
+    }
+    free_ranges.erase(it);
+}
+
+void DirtyRanges::add(uint64_t first, uint64_t count) {
+    if(count == 0) {
+        return;
+    }
+    uint64_t end = first + count;
+
+    // Swallow every range that overlaps or comes within merge_gap of [first, end)
+    auto it = ranges.upper_bound(first);
+    if(it != ranges.begin() && std::prev(it)->second + merge_gap >= first) {
+        --it;
+    }
+    while(it != ranges.end() && it->first <= end + merge_gap) {
+        first = std::min(first, it->first);
+        end = std::max(end, it->second);
+        it = ranges.erase(it);
+    }
+    ranges[first] = end;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+// Hands out byte ranges of a linear resource (a buffer or a block of device memory).
+// Freed ranges are merged with their neighbours and reused, best fit first.
+class RangeAllocator {
+public:
+    static constexpr uint64_t invalid_offset = ~0ull;
+
+    RangeAllocator() = default;
+    explicit RangeAllocator(uint64_t size);
+
+    // Returns invalid_offset if no free range fits, alignment does not need to be a power of two
+    uint64_t allocate(uint64_t size, uint64_t alignment);
+    void free(uint64_t offset);
+    // Adds [capacity(), new_size) to the free ranges
+    void grow(uint64_t new_size);
+
+    uint64_t capacity() const { return size; }
+    uint64_t used() const { return used_bytes; }
+    size_t allocation_count() const { return allocations.size(); }
+    size_t free_range_count() const { return free_ranges.size(); }
+    uint64_t largest_free_range() const;
+    // 0 when all free space is a single range, approaches 1 as it gets split into small pieces
+    float fragmentation() const;
+
+private:
+    uint64_t size = 0;
+    uint64_t used_bytes = 0;
+    std::map<uint64_t, uint64_t> free_ranges; // offset -> size
+    std::multimap<uint64_t, uint64_t> free_by_size; // size -> offset
+    std::map<uint64_t, uint64_t> allocations; // offset -> size
+
+    void insert_free_range(uint64_t offset, uint64_t range_size);
+    void erase_free_range(std::map<uint64_t, uint64_t>::iterator it);
+};
+
+// Set of touched [first, end) ranges, kept sorted and coalesced as they are added.
+// Ranges closer than merge_gap are merged too, copying a few untouched items costs less than another copy region.
+class DirtyRanges {
+public:
+    explicit DirtyRanges(uint64_t merge_gap = 0) : merge_gap(merge_gap) {}
+
+    void add(uint64_t first, uint64_t count);
+    void clear() { ranges.clear(); }
+    bool empty() const { return ranges.empty(); }
+    // first -> end
+    const std::map<uint64_t, uint64_t>& get() const { return ranges; }
+
+private:
+    uint64_t merge_gap;
+    std::map<uint64_t, uint64_t> ranges;
+};
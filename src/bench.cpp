@@ -0,0 +1,174 @@
+#include "bench.h"
+#include "soa.h"
+#include "jobs.h"
+#include "anim.h"
+#include "scene.h"
+#include <cmath>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+
+const size_t bench_soa_samples = 16 * 1024 * 1024;
+const int bench_repetitions = 5;
+const uint32_t bench_surface_size = 1024;
+const uint32_t bench_track_count = 64 * 1024;
+const uint32_t bench_track_keys = 8;
+const uint32_t bench_scene_groups = 4096;
+const uint32_t bench_scene_children = 64;
+
+// Best of bench_repetitions, in seconds
+template<typename F>
+double best_time(F&& f) {
+    double best = 1e30;
+    for(int i = 0; i != bench_repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+void report(const char* name, double seconds, size_t samples) {
+    double bytes = double(samples) * (3 * sizeof(float) + sizeof(Vertex));
+    std::cout << "  " << name << ": " << seconds * 1e9 / samples << " ns/sample, " << bytes / seconds / 1e9 << " GB/s\n";
+}
+
+void bench_soa() {
+    std::vector<float> x(bench_soa_samples), y(bench_soa_samples), z(bench_soa_samples);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for(size_t i = 0; i != bench_soa_samples; ++i) {
+        x[i] = dist(rng);
+        y[i] = dist(rng);
+        z[i] = dist(rng);
+    }
+    glm::vec4 color(1.0f);
+    // Stands in for the mapped staging range
+    std::vector<Vertex> mapped(bench_soa_samples);
+
+    std::cout << "SoA to Vertex, " << bench_soa_samples << " samples, best of " << bench_repetitions << "\n";
+
+    // What the VCurve path does without the kernels, an intermediate vector then a copy into mapped memory
+    double seconds = best_time([&]() {
+        std::vector<Vertex> vertices(bench_soa_samples);
+        for(size_t i = 0; i != bench_soa_samples; ++i) {
+            vertices[i] = {glm::vec4(x[i], y[i], z[i], 1.0f), color};
+        }
+        memcpy(mapped.data(), vertices.data(), vertices.size() * sizeof(Vertex));
+    });
+    report("per point + copy", seconds, bench_soa_samples);
+
+    for(SoaKernel kernel : {SoaKernel::eScalar, SoaKernel::eSSE, SoaKernel::eAVX2}) {
+        seconds = best_time([&]() {
+            glm::vec3 min(std::numeric_limits<float>::max());
+            glm::vec3 max(std::numeric_limits<float>::lowest());
+            soa_to_vertices(kernel, x.data(), y.data(), z.data(), bench_soa_samples, color, mapped.data(), min, max);
+        });
+        report(soa_kernel_name(kernel), seconds, bench_soa_samples);
+    }
+    std::cout << "  Selected at runtime: " << soa_kernel_name(best_soa_kernel()) << "\n";
+}
+
+void bench_jobs() {
+    auto f = [](float u, float v) {
+        float x = 2.0f * u - 1.0f;
+        float y = 2.0f * v - 1.0f;
+        float z = std::sin(8.0f * x) * std::cos(8.0f * y);
+        glm::vec3 normal(-8.0f * std::cos(8.0f * x) * std::cos(8.0f * y), 8.0f * std::sin(8.0f * x) * std::sin(8.0f * y), 1.0f);
+        return SurfaceSample {glm::vec3(x, y, z), normal};
+    };
+    VSurface surface(f, bench_surface_size, bench_surface_size);
+    size_t samples = size_t(bench_surface_size) * bench_surface_size;
+
+    uint32_t max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::cout << "VSurface " << bench_surface_size << "x" << bench_surface_size << " tessellation, best of " << bench_repetitions << "\n";
+    double single = 0.0;
+    for(uint32_t threads = 1; threads <= max_threads; threads = threads == max_threads ? threads + 1 : std::min(threads * 2, max_threads)) {
+        JobSystem jobs(threads);
+        double seconds = best_time([&]() {
+            surface.tessellate(f, jobs);
+        });
+        if(threads == 1) {
+            single = seconds;
+        }
+        std::cout << "  " << threads << " threads: " << seconds * 1e3 << " ms, " << seconds * 1e9 / samples << " ns/vertex, "
+            << single / seconds << "x\n";
+    }
+}
+
+void bench_anim() {
+    // Half Hermite translations, half eased colors, as an animated curve would have
+    Animator animator;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for(uint32_t i = 0; i != bench_track_count; ++i) {
+        Track track;
+        track.object = {i, 0};
+        track.target = i % 2 == 0 ? TrackTarget::eTranslation : TrackTarget::eColor;
+        track.interpolation = i % 2 == 0 ? Interpolation::eHermite : Interpolation::eEaseInOut;
+        track.loop = true;
+        uint32_t width = i % 2 == 0 ? 3 : 4;
+        for(uint32_t k = 0; k != bench_track_keys; ++k) {
+            track.times.push_back(k * 0.5f);
+            for(uint32_t c = 0; c != width; ++c) {
+                track.values.push_back(dist(rng));
+            }
+        }
+        animator.add(track);
+    }
+
+    uint32_t max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::cout << "Animation, " << bench_track_count << " tracks of " << bench_track_keys << " keys, best of " << bench_repetitions << "\n";
+    double single = 0.0;
+    for(uint32_t threads = 1; threads <= max_threads; threads = threads == max_threads ? threads + 1 : std::min(threads * 2, max_threads)) {
+        JobSystem jobs(threads);
+        double seconds = best_time([&]() {
+            animator.advance(1.0 / 60.0);
+            animator.evaluate(jobs);
+        });
+        if(threads == 1) {
+            single = seconds;
+        }
+        std::cout << "  " << threads << " threads: " << seconds * 1e3 << " ms, " << seconds * 1e9 / bench_track_count << " ns/track, "
+            << single / seconds << "x\n";
+    }
+}
+
+void bench_scene() {
+    // Groups of curves under shared parents, two levels deep
+    SceneGraph scene;
+    std::vector<SceneNode> groups;
+    glm::mat4 offset(1.0f);
+    offset[3] = glm::vec4(0.1f, 0.0f, 0.0f, 1.0f);
+    for(uint32_t g = 0; g != bench_scene_groups; ++g) {
+        groups.push_back(scene.add());
+        for(uint32_t c = 0; c != bench_scene_children; ++c) {
+            scene.add(groups.back(), offset);
+        }
+    }
+    scene.update();
+
+    uint32_t max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::cout << "Scene graph, " << scene.size() << " nodes, best of " << bench_repetitions << "\n";
+    for(uint32_t moving : {bench_scene_groups, bench_scene_groups / 100}) {
+        double single = 0.0;
+        for(uint32_t threads = 1; threads <= max_threads; threads = threads == max_threads ? threads + 1 : std::min(threads * 2, max_threads)) {
+            JobSystem jobs(threads);
+            double seconds = best_time([&]() {
+                for(uint32_t g = 0; g != moving; ++g) {
+                    scene.set_local(groups[g * (bench_scene_groups / moving)], offset);
+                }
+                scene.update(jobs);
+            });
+            if(threads == 1) {
+                single = seconds;
+            }
+            std::cout << "  " << moving << " groups moving, " << threads << " threads: " << seconds * 1e3 << " ms, "
+                << scene.updated_count() << " nodes updated, " << single / seconds << "x\n";
+        }
+    }
+}
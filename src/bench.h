@@ -0,0 +1,15 @@
+#pragma once
+
+// Microbenchmarks, run from the command line instead of rendering
+
+// SoA to interleaved Vertex conversion, every kernel against the per point copy it replaces
+void bench_soa();
+
+// Surface tessellation on the job system, from one thread up to every hardware thread
+void bench_jobs();
+
+// Keyframe track evaluation, from one thread up to every hardware thread
+void bench_anim();
+
+// Scene graph world matrix updates, with every parent moving and with a few
+void bench_scene();
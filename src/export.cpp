@@ -0,0 +1,169 @@
+#include "export.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+FrameExporter::FrameExporter(
+    vk::Device device, DeviceAllocator& allocator, vk::Extent2D extent, vk::Format format,
+    const std::string& target, ExportFormat export_format, uint32_t fps, uint32_t slot_count
+) : device(device), allocator(allocator), extent(extent), export_format(export_format) {
+    bgra = format == vk::Format::eB8G8R8A8Unorm || format == vk::Format::eB8G8R8A8Srgb;
+
+    if(!target.empty() && target[0] == '|') {
+        output = popen(target.c_str() + 1, "w");
+        pipe = true;
+    } else {
+        output = std::fopen(target.c_str(), "wb");
+    }
+    if(!output) {
+        std::cerr << "Could not open export target " << target << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    if(export_format == ExportFormat::eY4M) {
+        std::fprintf(output, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444 XCOLORRANGE=LIMITED\n", extent.width, extent.height, fps);
+    }
+
+    // Cached memory makes the writer's reads much faster on discrete GPUs, where uncached reads go over PCIe
+    vk::MemoryPropertyFlags flags = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+    if(allocator.has_memory_type(flags | vk::MemoryPropertyFlagBits::eHostCached)) {
+        flags |= vk::MemoryPropertyFlagBits::eHostCached;
+    }
+
+    vk::DeviceSize frame_size = vk::DeviceSize(extent.width) * extent.height * 4;
+    slots.resize(std::max(1u, slot_count));
+    for(auto& slot : slots) {
+        slot.buffer = device.createBuffer(vk::BufferCreateInfo(vk::BufferCreateFlags(), frame_size, vk::BufferUsageFlagBits::eTransferDst));
+        slot.memory = allocator.allocate_buffer(slot.buffer, flags);
+        slot.fence = device.createFence(vk::FenceCreateInfo());
+    }
+    scratch.resize(frame_size);
+
+    writer = std::thread(&FrameExporter::write_loop, this);
+}
+
+FrameExporter::~FrameExporter() {
+    finish();
+}
+
+vk::Buffer FrameExporter::begin_frame() {
+    std::unique_lock<std::mutex> lock(mutex);
+    Slot& slot = slots[next_slot];
+    cv.wait(lock, [&slot] { return !slot.busy; });
+    slot.busy = true;
+    return slot.buffer;
+}
+
+void FrameExporter::end_frame(vk::Queue queue) {
+    // An empty submit signals its fence once all previously submitted work, the copy included, is done
+    queue.submit(nullptr, slots[next_slot].fence);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(next_slot);
+    }
+    cv.notify_all();
+    next_slot = (next_slot + 1) % slots.size();
+}
+
+void FrameExporter::finish() {
+    if(!writer.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    writer.join();
+    std::cout << "Exported " << written << " frames\n";
+
+    if(pipe) {
+        pclose(output);
+    } else {
+        std::fclose(output);
+    }
+    output = nullptr;
+
+    for(auto& slot : slots) {
+        device.destroyFence(slot.fence);
+        device.destroyBuffer(slot.buffer);
+        allocator.free(slot.memory);
+    }
+    slots.clear();
+}
+
+void FrameExporter::write_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        cv.wait(lock, [this] { return stop || !pending.empty(); });
+        // Frames still queued when stopping are written out first
+        if(pending.empty()) {
+            return;
+        }
+
+        uint32_t index = pending.front();
+        pending.pop_front();
+        lock.unlock();
+
+        Slot& slot = slots[index];
+        while(vk::Result::eTimeout == device.waitForFences(slot.fence, VK_TRUE, 100000000))
+            ;
+        device.resetFences(slot.fence);
+        write_frame(reinterpret_cast<const uint8_t*>(slot.memory.mapped));
+
+        lock.lock();
+        slot.busy = false;
+        ++written;
+        cv.notify_all();
+    }
+}
+
+void FrameExporter::write_frame(const uint8_t* pixels) {
+    size_t pixel_count = size_t(extent.width) * extent.height;
+    uint32_t r = bgra ? 2 : 0;
+    uint32_t b = bgra ? 0 : 2;
+
+    switch(export_format) {
+        case ExportFormat::eRaw:
+            if(!bgra) {
+                std::fwrite(pixels, 4, pixel_count, output);
+                break;
+            }
+            for(size_t i = 0; i != pixel_count; ++i) {
+                scratch[i * 4 + 0] = pixels[i * 4 + r];
+                scratch[i * 4 + 1] = pixels[i * 4 + 1];
+                scratch[i * 4 + 2] = pixels[i * 4 + b];
+                scratch[i * 4 + 3] = pixels[i * 4 + 3];
+            }
+            std::fwrite(scratch.data(), 4, pixel_count, output);
+            break;
+        case ExportFormat::ePPM:
+            std::fprintf(output, "P6\n%u %u\n255\n", extent.width, extent.height);
+            for(size_t i = 0; i != pixel_count; ++i) {
+                scratch[i * 3 + 0] = pixels[i * 4 + r];
+                scratch[i * 3 + 1] = pixels[i * 4 + 1];
+                scratch[i * 3 + 2] = pixels[i * 4 + b];
+            }
+            std::fwrite(scratch.data(), 3, pixel_count, output);
+            break;
+        case ExportFormat::eY4M: {
+            // BT.601 limited range, planar Y then U then V
+            uint8_t* y_plane = scratch.data();
+            uint8_t* u_plane = y_plane + pixel_count;
+            uint8_t* v_plane = u_plane + pixel_count;
+            for(size_t i = 0; i != pixel_count; ++i) {
+                int R = pixels[i * 4 + r];
+                int G = pixels[i * 4 + 1];
+                int B = pixels[i * 4 + b];
+                y_plane[i] = static_cast<uint8_t>(16 + ((66 * R + 129 * G + 25 * B + 128) >> 8));
+                u_plane[i] = static_cast<uint8_t>(128 + ((-38 * R - 74 * G + 112 * B + 128) >> 8));
+                v_plane[i] = static_cast<uint8_t>(128 + ((112 * R - 94 * G - 18 * B + 128) >> 8));
+            }
+            std::fputs("FRAME\n", output);
+            std::fwrite(scratch.data(), 1, pixel_count * 3, output);
+            break;
+        }
+    }
+}
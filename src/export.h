@@ -0,0 +1,68 @@
+#pragma once
+
+#include "allocator.h"
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+enum class ExportFormat {
+    eRaw, // RGBA8 rows, no header
+    ePPM, // One binary P6 image per frame
+    eY4M  // YUV4MPEG2 4:4:4, ready for ffmpeg or x264
+};
+
+// Streams rendered frames to a file, or to a command's stdin when the target starts with '|'.
+// The render loop copies each frame into one of a ring of host visible readback buffers and
+// a writer thread drains them once their fence signals, so writing frame N overlaps rendering N+1, N+2...
+class FrameExporter {
+public:
+    FrameExporter(
+        vk::Device device, DeviceAllocator& allocator, vk::Extent2D extent, vk::Format format,
+        const std::string& target, ExportFormat export_format, uint32_t fps, uint32_t slot_count
+    );
+    FrameExporter(const FrameExporter&) = delete;
+    FrameExporter& operator=(const FrameExporter&) = delete;
+    ~FrameExporter();
+
+    // Blocks until the writer has released the next slot, returns the buffer the frame should be copied into
+    vk::Buffer begin_frame();
+    // Call right after the submit holding the copy, the slot's fence signals once that work is done
+    void end_frame(vk::Queue queue);
+    // Writes every pending frame and closes the output
+    void finish();
+
+private:
+    struct Slot {
+        vk::Buffer buffer {};
+        Allocation memory {};
+        vk::Fence fence {};
+        bool busy = false; // Between begin_frame and the writer being done with it
+    };
+
+    vk::Device device;
+    DeviceAllocator& allocator;
+    vk::Extent2D extent;
+    bool bgra; // Swapchain images are usually BGRA, offscreen ones RGBA
+    ExportFormat export_format;
+    std::FILE* output = nullptr;
+    bool pipe = false;
+
+    std::vector<Slot> slots;
+    uint32_t next_slot = 0;
+    std::vector<uint8_t> scratch; // Converted frame, only touched by the writer
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread writer;
+    std::deque<uint32_t> pending; // Submitted slots, in frame order
+    bool stop = false;
+    uint64_t written = 0;
+
+    void write_loop();
+    void write_frame(const uint8_t* rgba);
+};
@@ -0,0 +1,190 @@
+#include "jobs.h"
+#include <algorithm>
+
+struct Job : std::enable_shared_from_this<Job> {
+    std::function<void()> f;
+    // The job's own run plus any ranges it split into, it is finished at zero
+    std::atomic<uint32_t> unfinished {1};
+    // Unfinished dependencies plus one until submit is done adding them, it is queued at zero
+    std::atomic<uint32_t> blocked {1};
+    std::atomic<bool> done {false};
+    JobHandle parent;
+
+    std::mutex mutex;
+    std::vector<JobHandle> dependents;
+};
+
+// Which queue the current thread owns, 0 for threads that are not workers of this system
+thread_local const JobSystem* current_system = nullptr;
+thread_local uint32_t current_queue = 0;
+
+JobSystem::JobSystem(uint32_t thread_count) {
+    if(thread_count == 0) {
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    for(uint32_t i = 0; i != thread_count; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    workers.reserve(thread_count - 1);
+    for(uint32_t i = 1; i != thread_count; ++i) {
+        workers.emplace_back(&JobSystem::worker_loop, this, i);
+    }
+}
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for(auto& worker : workers) {
+        worker.join();
+    }
+}
+
+JobHandle JobSystem::submit(std::function<void()> f, const std::vector<JobHandle>& dependencies) {
+    auto job = std::make_shared<Job>();
+    job->f = std::move(f);
+    schedule(job, dependencies);
+    return job;
+}
+
+void JobSystem::schedule(const JobHandle& job, const std::vector<JobHandle>& dependencies) {
+    for(const JobHandle& dependency : dependencies) {
+        if(!dependency) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(dependency->mutex);
+        if(!dependency->done) {
+            dependency->dependents.push_back(job);
+            ++job->blocked;
+        }
+    }
+    if(--job->blocked == 0) {
+        push(job);
+    }
+}
+
+// The ranges are only queued once the dependencies are met, by a job that is finished when they all are
+JobHandle JobSystem::parallel_for(
+    size_t begin, size_t end, size_t grain, std::function<void(size_t first, size_t last)> f,
+    const std::vector<JobHandle>& dependencies
+) {
+    grain = std::max<size_t>(grain, 1);
+    auto body = std::make_shared<std::function<void(size_t, size_t)>>(std::move(f));
+    auto job = std::make_shared<Job>();
+    Job* raw = job.get();
+    job->f = [this, raw, begin, end, grain, body]() {
+        JobHandle self = raw->shared_from_this();
+        size_t ranges = end > begin ? (end - begin + grain - 1) / grain : 0;
+        self->unfinished += ranges;
+        for(size_t first = begin; first < end; first += grain) {
+            size_t last = std::min(first + grain, end);
+            auto range = std::make_shared<Job>();
+            range->f = [body, first, last]() {
+                (*body)(first, last);
+            };
+            range->blocked = 0;
+            range->parent = self;
+            push(range);
+        }
+    };
+    schedule(job, dependencies);
+    return job;
+}
+
+void JobSystem::wait(const JobHandle& job) {
+    while(job && !job->done) {
+        if(!run_one()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool JobSystem::finished(const JobHandle& job) const {
+    return !job || job->done;
+}
+
+void JobSystem::worker_loop(uint32_t index) {
+    current_system = this;
+    current_queue = index;
+    while(true) {
+        if(run_one()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this]() {
+            return queued > 0 || stop;
+        });
+        if(stop) {
+            return;
+        }
+    }
+}
+
+// Onto the back of the calling thread's own queue, where it is likely the next job that thread runs
+void JobSystem::push(JobHandle job) {
+    uint32_t index = current_system == this ? current_queue : 0;
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->jobs.push_back(std::move(job));
+    }
+    ++queued;
+    // Taking the lock orders this with a worker checking queued before it sleeps, so the wake is not lost
+    { std::lock_guard<std::mutex> lock(sleep_mutex); }
+    wake.notify_one();
+}
+
+// Newest job from the own queue, otherwise the oldest from the next queue that has one
+bool JobSystem::run_one() {
+    uint32_t own = current_system == this ? current_queue : 0;
+    JobHandle job;
+    for(uint32_t i = 0; i != queues.size() && !job; ++i) {
+        Queue& queue = *queues[(own + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.jobs.empty()) {
+            continue;
+        }
+        if(i == 0) {
+            job = std::move(queue.jobs.back());
+            queue.jobs.pop_back();
+        } else {
+            job = std::move(queue.jobs.front());
+            queue.jobs.pop_front();
+        }
+    }
+    if(!job) {
+        return false;
+    }
+    --queued;
+    job->f();
+    job->f = nullptr;
+    complete(job);
+    return true;
+}
+
+void JobSystem::complete(const JobHandle& job) {
+    if(--job->unfinished != 0) {
+        return;
+    }
+    std::vector<JobHandle> dependents;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->done = true;
+        dependents.swap(job->dependents);
+    }
+    for(const JobHandle& dependent : dependents) {
+        if(--dependent->blocked == 0) {
+            push(dependent);
+        }
+    }
+    if(job->parent) {
+        JobHandle parent = std::move(job->parent);
+        complete(parent);
+    }
+}
+
+JobSystem& job_system() {
+    static JobSystem jobs;
+    return jobs;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Job;
+using JobHandle = std::shared_ptr<Job>;
+
+// Work-stealing thread pool. Each worker pushes and pops jobs at the back of its own queue and steals
+// from the front of the others' when it runs dry, so related jobs stay on one core and idle cores pick
+// up the rest. Threads that are not workers, like the render loop, help out while they wait.
+class JobSystem {
+public:
+    // thread_count counts the thread calling wait, so 1 runs everything inline in wait. 0 uses every hardware thread.
+    explicit JobSystem(uint32_t thread_count = 0);
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+    ~JobSystem();
+
+    // Runs f once every dependency has finished. Empty handles count as finished.
+    JobHandle submit(std::function<void()> f, const std::vector<JobHandle>& dependencies = {});
+    // Calls f(first, last) over [begin, end) in ranges of about grain items. The handle finishes with the last range.
+    JobHandle parallel_for(
+        size_t begin, size_t end, size_t grain, std::function<void(size_t first, size_t last)> f,
+        const std::vector<JobHandle>& dependencies = {}
+    );
+    // Runs queued jobs until job has finished
+    void wait(const JobHandle& job);
+    bool finished(const JobHandle& job) const;
+
+    uint32_t thread_count() const { return workers.size() + 1; }
+
+private:
+    // Queue 0 is shared by every thread that is not a worker, worker i owns queue i + 1
+    struct Queue {
+        std::mutex mutex;
+        std::deque<JobHandle> jobs;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<uint32_t> queued {0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stop = false;
+
+    void worker_loop(uint32_t index);
+    void schedule(const JobHandle& job, const std::vector<JobHandle>& dependencies);
+    void push(JobHandle job);
+    bool run_one();
+    void complete(const JobHandle& job);
+};
+
+// Shared pool with a thread per hardware thread, started on first use
+JobSystem& job_system();
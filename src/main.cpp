@@ -1,7 +1,69 @@
 #include "render.h"
+#include "bench.h"
+#include "spline.h"
+#include "anim.h"
+#include "scene.h"
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <glm/gtc/constants.hpp>
+
+int main(int argc, char** argv) {
+    bool headless = false;
+    uint64_t frame_count = 0;
+    std::string export_target;
+    ExportFormat export_format = ExportFormat::eY4M;
+    uint32_t fps = 30;
+    bool on_demand = false;
+    std::string profile_path;
+    for(int i = 1; i < argc; ++i) {
+        if(std::strcmp(argv[i], "--bench-soa") == 0) {
+            bench_soa();
+            return 0;
+        } else if(std::strcmp(argv[i], "--bench-jobs") == 0) {
+            bench_jobs();
+            return 0;
+        } else if(std::strcmp(argv[i], "--bench-anim") == 0) {
+            bench_anim();
+            return 0;
+        } else if(std::strcmp(argv[i], "--bench-scene") == 0) {
+            bench_scene();
+            return 0;
+        } else if(std::strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if(std::strcmp(argv[i], "--on-demand") == 0) {
+            on_demand = true;
+        } else if(std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frame_count = std::strtoull(argv[++i], nullptr, 10);
+        } else if(std::strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_target = argv[++i];
+        } else if(std::strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            std::string format = argv[++i];
+            if(format == "raw") {
+                export_format = ExportFormat::eRaw;
+            } else if(format == "ppm") {
+                export_format = ExportFormat::ePPM;
+            } else if(format == "y4m") {
+                export_format = ExportFormat::eY4M;
+            } else {
+                std::cerr << "Unknown export format " << format << ", expected raw, ppm or y4m\n";
+                return EXIT_FAILURE;
+            }
+        } else if(std::strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            fps = std::strtoul(argv[++i], nullptr, 10);
+        } else if(std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--headless] [--on-demand] [--frames N] [--export PATH|'|COMMAND'] [--format raw|ppm|y4m] [--fps N] [--profile PATH.json|PATH.csv] [--bench-soa] [--bench-jobs] [--bench-anim] [--bench-scene]\n";
+            return EXIT_FAILURE;
+        }
+    }
+    // A headless render has no window to close
+    if(headless && frame_count == 0) {
+        frame_count = 1;
+    }
 
-int main(void) {
     std::vector<Vertex> vertices {
         {glm::vec4(0.0, -0.5, 0.0, 1.0), glm::vec4(0.2f, 0.5f, 0.5f, 1.0f)},
         {glm::vec4(0.5, 0.5, 0.0, 1.0), glm::vec4(0.2f, 0.5f, 0.5f, 1.0f)},
@@ -9,8 +71,98 @@ int main(void) {
         {glm::vec4(0.0, -0.5, 0.0, 1.0), glm::vec4(0.2f, 0.5f, 0.5f, 1.0f)}
     };
     VObject triangle {vertices, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)};
-    Render r(640, 800, "vk-anim");
-    r.add_vobject(triangle);
-    r.loop();
+    Render r(640, 800, "vk-anim", 2, headless);
+    ObjectHandle triangle_handle = r.add_vobject(triangle);
+    VCurve circle([](float t) {
+        return glm::vec3(0.25f * std::cos(t), 0.25f * std::sin(t), 0.0f);
+    }, 0.0f, 2.0f * glm::pi<float>(), default_curve_tolerance, glm::vec4(0.9f, 0.6f, 0.2f, 1.0f));
+    // 8 bytes per vertex instead of 32, half float positions and one color for the whole curve
+    PipelineKey compact {};
+    compact.format = {PositionFormat::eHalf4, ColorFormat::eObject};
+    ObjectHandle circle_handle = r.add_vobject(circle, compact);
+
+    // The triangle and the circle turn together under one node, the circle also loops around the corners
+    // on its own. Only GPU transforms change, the vertices stay centred on the origin.
+    SceneGraph scene;
+    SceneNode group = scene.add();
+    scene.add(group, glm::mat4(1.0f), triangle_handle);
+    SceneNode circle_node = scene.add(group, glm::mat4(1.0f), circle_handle);
+
+    Animator animator;
+    Track spin;
+    spin.node = group;
+    spin.target = TrackTarget::eRotation;
+    spin.loop = true;
+    // Quarter turns about z, few enough degrees apart for normalized linear blending
+    spin.times = {0.0f, 2.0f, 4.0f, 6.0f, 8.0f};
+    spin.values = {0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.7071f, 0.7071f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.7071f, -0.7071f, 0.0f, 0.0f, 0.0f, -1.0f};
+    animator.add(spin);
+    Track orbit;
+    orbit.node = circle_node;
+    orbit.target = TrackTarget::eTranslation;
+    orbit.interpolation = Interpolation::eHermite;
+    orbit.loop = true;
+    orbit.times = {0.0f, 1.0f, 2.0f, 3.0f, 4.0f};
+    orbit.values = {0.3f, 0.3f, 0.0f, -0.3f, 0.3f, 0.0f, -0.3f, -0.3f, 0.0f, 0.3f, -0.3f, 0.0f, 0.3f, 0.3f, 0.0f};
+    animator.add(orbit);
+    Track fade;
+    fade.object = circle_handle;
+    fade.target = TrackTarget::eColor;
+    fade.interpolation = Interpolation::eEaseInOut;
+    fade.loop = true;
+    fade.times = {0.0f, 2.0f, 4.0f};
+    fade.values = {0.9f, 0.6f, 0.2f, 1.0f, 0.2f, 0.6f, 0.9f, 1.0f, 0.9f, 0.6f, 0.2f, 1.0f};
+    animator.add(fade);
+    r.set_frame_callback([&](double seconds) {
+        animator.update(r, seconds, &scene);
+        scene.update();
+        scene.apply(r);
+        if(animator.running()) {
+            r.request_frame();
+        }
+    });
+
+    std::vector<glm::vec3> control {{-0.8f, 0.6f, 0.0f}, {-0.4f, -0.6f, 0.0f}, {0.4f, 0.9f, 0.0f}, {0.8f, -0.3f, 0.0f}};
+    std::vector<float> t(256);
+    for(size_t i = 0; i != t.size(); ++i) {
+        t[i] = i / float(t.size() - 1);
+    }
+    PipelineKey quantized {};
+    quantized.format = {PositionFormat::eQuantized16, ColorFormat::eUnorm8};
+    r.add_vertices(t.size(), control_bounds(control.data(), control.size()), [&](Vertex* out, size_t first, size_t n) {
+        eval_bezier(control.data(), t.data() + first, n, glm::vec4(0.3f, 0.8f, 0.4f, 1.0f), out);
+    }, quantized);
+
+    // Ripples around the centre, behind the curves
+    VSurface surface([](float u, float v) {
+        float x = 0.9f * (2.0f * u - 1.0f);
+        float y = 0.9f * (2.0f * v - 1.0f);
+        float r = std::sqrt(x * x + y * y);
+        float z = 0.5f + 0.3f * std::cos(12.0f * r) * std::exp(-2.0f * r);
+        // Normal of z = h(x, y) is (-dh/dx, -dh/dy, 1)
+        float dz_dr = r > 0.0f ? -0.3f * std::exp(-2.0f * r) * (12.0f * std::sin(12.0f * r) + 2.0f * std::cos(12.0f * r)) : 0.0f;
+        float dz_dx = r > 0.0f ? dz_dr * x / r : 0.0f;
+        float dz_dy = r > 0.0f ? dz_dr * y / r : 0.0f;
+        return SurfaceSample {glm::vec3(x, y, z), glm::vec3(-dz_dx, -dz_dy, 1.0f)};
+    }, 128, 128, glm::vec4(0.3f, 0.4f, 0.8f, 1.0f));
+    r.add_vsurface(surface);
+    if(!export_target.empty()) {
+        r.export_frames(export_target, export_format, fps);
+    }
+    r.set_on_demand(on_demand);
+    if(!profile_path.empty()) {
+        r.enable_profiling();
+    }
+    r.loop(frame_count);
+    if(!profile_path.empty()) {
+        r.get_profiler()->save(profile_path);
+    }
+    CommandBufferStats stats = r.get_command_buffer_stats();
+    std::cout << "Command buffers: " << stats.recorded << " recorded, " << stats.reused << " reused, " << stats.draw_chunks << " draw chunks\n";
+    if(on_demand) {
+        LoopStats loop_stats = r.get_loop_stats();
+        std::cout << "On demand: " << loop_stats.frames << " frames drawn, " << loop_stats.idle_wakes << " idle wakes, "
+            << loop_stats.idle_seconds << " s idle\n";
+    }
     return 0;
 }
\ No newline at end of file
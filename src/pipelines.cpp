@@ -0,0 +1,297 @@
+#include "pipelines.h"
+#include <array>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+bool PipelineKey::operator==(const PipelineKey& other) const {
+    return topology == other.topology &&
+        format == other.format &&
+        blend == other.blend &&
+        depth_test == other.depth_test &&
+        depth_write == other.depth_write &&
+        point_size == other.point_size &&
+        alpha_scale == other.alpha_scale;
+}
+
+size_t PipelineKeyHash::operator()(const PipelineKey& key) const {
+    uint32_t point_size_bits;
+    uint32_t alpha_scale_bits;
+    memcpy(&point_size_bits, &key.point_size, sizeof(uint32_t));
+    memcpy(&alpha_scale_bits, &key.alpha_scale, sizeof(uint32_t));
+
+    size_t h = static_cast<size_t>(key.topology);
+    h = h * 31 + static_cast<size_t>(key.format.position);
+    h = h * 31 + static_cast<size_t>(key.format.color);
+    h = h * 31 + static_cast<size_t>(key.blend);
+    h = h * 31 + key.depth_test;
+    h = h * 31 + key.depth_write;
+    h = h * 31 + point_size_bits;
+    h = h * 31 + alpha_scale_bits;
+    return h;
+}
+
+vk::Format position_format(PositionFormat format) {
+    switch(format) {
+        case PositionFormat::eFloat4:
+            return vk::Format::eR32G32B32A32Sfloat;
+        case PositionFormat::eFloat3:
+            return vk::Format::eR32G32B32Sfloat;
+        case PositionFormat::eHalf4:
+            return vk::Format::eR16G16B16A16Sfloat;
+        case PositionFormat::eQuantized16:
+            return vk::Format::eR16G16B16A16Unorm;
+    }
+    return vk::Format::eR32G32B32A32Sfloat;
+}
+
+vk::Format color_format(ColorFormat format) {
+    switch(format) {
+        case ColorFormat::eFloat4:
+            return vk::Format::eR32G32B32A32Sfloat;
+        case ColorFormat::eUnorm8:
+        case ColorFormat::eObject:
+            return vk::Format::eR8G8B8A8Unorm;
+    }
+    return vk::Format::eR32G32B32A32Sfloat;
+}
+
+PipelineRegistry::~PipelineRegistry() {
+    destroy();
+}
+
+void PipelineRegistry::init(const Config& c, vk::PipelineCreationFeedback* feedback) {
+    config = c;
+    PipelineKey default_key {};
+    fallback = build(default_key, feedback);
+    if(!fallback) {
+        std::exit(EXIT_FAILURE);
+    }
+    pipelines[default_key] = fallback;
+    requested.insert(default_key);
+
+    worker = std::thread(&PipelineRegistry::compile_loop, this);
+}
+
+void PipelineRegistry::destroy() {
+    if(!worker.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_one();
+    worker.join();
+
+    for(auto& [key, pipeline] : pipelines) {
+        config.device.destroyPipeline(pipeline);
+    }
+    pipelines.clear();
+    requested.clear();
+    queue.clear();
+    config.device.destroyShaderModule(config.vertex_shader);
+    config.device.destroyShaderModule(config.fragment_shader);
+}
+
+vk::Pipeline PipelineRegistry::get(const PipelineKey& key, bool* ready) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // The compile thread only reports failures, the renderer is shut down from the thread using it
+    if(failed) {
+        std::exit(EXIT_FAILURE);
+    }
+    auto it = pipelines.find(key);
+    if(ready) {
+        *ready = it != pipelines.end();
+    }
+    if(it != pipelines.end()) {
+        return it->second;
+    }
+
+    if(requested.insert(key).second) {
+        queue.push_back(key);
+        cv.notify_one();
+    }
+    const PipelineKey default_key {};
+    bool compatible = key.format == default_key.format && key.topology == default_key.topology;
+    return compatible ? fallback : vk::Pipeline {};
+}
+
+void PipelineRegistry::compile_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        cv.wait(lock, [this] { return stop || !queue.empty(); });
+        if(stop) {
+            return;
+        }
+
+        PipelineKey key = queue.front();
+        queue.pop_front();
+
+        // The pipeline cache is internally synchronized, the render loop keeps going while this compiles
+        lock.unlock();
+        vk::Pipeline pipeline = build(key, nullptr);
+        lock.lock();
+
+        if(!pipeline) {
+            failed = true;
+        } else {
+            pipelines[key] = pipeline;
+        }
+        // Also after a failure, so an idle render loop gets to see it
+        if(config.on_ready) {
+            lock.unlock();
+            config.on_ready();
+            lock.lock();
+        }
+    }
+}
+
+vk::Pipeline PipelineRegistry::build(const PipelineKey& key, vk::PipelineCreationFeedback* feedback) {
+    struct {
+        float point_size;
+        VkBool32 quantized_position;
+        VkBool32 object_color;
+    } vertex_spec_data {
+        key.point_size, key.format.position == PositionFormat::eQuantized16, key.format.color == ColorFormat::eObject
+    };
+    std::array<vk::SpecializationMapEntry, 3> vertex_spec_entries = {
+        vk::SpecializationMapEntry(0, offsetof(decltype(vertex_spec_data), point_size), sizeof(float)),
+        vk::SpecializationMapEntry(2, offsetof(decltype(vertex_spec_data), quantized_position), sizeof(VkBool32)),
+        vk::SpecializationMapEntry(3, offsetof(decltype(vertex_spec_data), object_color), sizeof(VkBool32))
+    };
+    vk::SpecializationInfo vertex_spec_info(
+        vertex_spec_entries.size(), vertex_spec_entries.data(), sizeof(vertex_spec_data), &vertex_spec_data
+    );
+    vk::SpecializationMapEntry fragment_spec_entry(1, 0, sizeof(float));
+    vk::SpecializationInfo fragment_spec_info(1, &fragment_spec_entry, sizeof(float), &key.alpha_scale);
+
+    std::array<vk::PipelineShaderStageCreateInfo, 2> pipeline_shader_stage_create_infos = {
+        vk::PipelineShaderStageCreateInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eVertex, config.vertex_shader, "main", &vertex_spec_info),
+        vk::PipelineShaderStageCreateInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eFragment, config.fragment_shader, "main", &fragment_spec_info),
+    };
+
+    vk::VertexInputBindingDescription vertex_input_binding_description(0, key.format.stride());
+    std::array<vk::VertexInputAttributeDescription, 2> vertex_input_attribute_descriptions = {
+        vk::VertexInputAttributeDescription(0, 0, position_format(key.format.position), 0),
+        vk::VertexInputAttributeDescription(1, 0, color_format(key.format.color), key.format.position_size())
+    };
+    // in_color is still declared, per object colors point it at the position bytes and test.vert ignores it
+    if(key.format.color == ColorFormat::eObject) {
+        vertex_input_attribute_descriptions[1].offset = 0;
+    }
+
+    vk::PipelineVertexInputStateCreateInfo pipeline_vertex_input_state_create_info(vk::PipelineVertexInputStateCreateFlags(), vertex_input_binding_description, vertex_input_attribute_descriptions);
+    vk::PipelineInputAssemblyStateCreateInfo pipeline_input_assembly_state_create_info(vk::PipelineInputAssemblyStateCreateFlags(), key.topology);
+
+    vk::PipelineViewportStateCreateInfo pipeline_viewport_state_create_info(vk::PipelineViewportStateCreateFlags(), 1, nullptr, 1, nullptr);
+
+    vk::PipelineRasterizationStateCreateInfo pipeline_rasterization_state_create_info(
+        vk::PipelineRasterizationStateCreateFlags(),
+        false,
+        false,
+        vk::PolygonMode::eFill,
+        // Surfaces are open and seen from both sides, lines and points are never culled anyway
+        vk::CullModeFlagBits::eNone,
+        vk::FrontFace::eClockwise,
+        false,
+        0.0f,
+        0.0f,
+        0.0f,
+        1.0f
+    );
+
+    vk::PipelineMultisampleStateCreateInfo pipeline_multisample_state_create_info(vk::PipelineMultisampleStateCreateFlags(), vk::SampleCountFlagBits::e1);
+
+    vk::StencilOpState stencil_op_state(vk::StencilOp::eKeep, vk::StencilOp::eKeep, vk::StencilOp::eKeep, vk::CompareOp::eAlways);
+    vk::PipelineDepthStencilStateCreateInfo pipeline_depth_stencil_state_create_info(
+        vk::PipelineDepthStencilStateCreateFlags(),
+        key.depth_test,
+        key.depth_write,
+        vk::CompareOp::eLessOrEqual,
+        false,
+        false,
+        stencil_op_state,
+        stencil_op_state
+    );
+
+    vk::BlendFactor src_factor = vk::BlendFactor::eZero;
+    vk::BlendFactor dst_factor = vk::BlendFactor::eZero;
+    switch(key.blend) {
+        case BlendMode::eOpaque:
+            break;
+        case BlendMode::eAlpha:
+            src_factor = vk::BlendFactor::eSrcAlpha;
+            dst_factor = vk::BlendFactor::eOneMinusSrcAlpha;
+            break;
+        case BlendMode::eAdditive:
+            src_factor = vk::BlendFactor::eOne;
+            dst_factor = vk::BlendFactor::eOne;
+            break;
+    }
+
+    vk::ColorComponentFlags color_component_flags(vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA);
+    vk::PipelineColorBlendAttachmentState pipeline_color_blend_attachment_state(
+        key.blend != BlendMode::eOpaque,
+        src_factor,
+        dst_factor,
+        vk::BlendOp::eAdd,
+        src_factor,
+        dst_factor,
+        vk::BlendOp::eAdd,
+        color_component_flags
+    );
+
+    vk::PipelineColorBlendStateCreateInfo pipeline_color_blend_state_create_info(
+        vk::PipelineColorBlendStateCreateFlags(),
+        false,
+        vk::LogicOp::eNoOp,
+        pipeline_color_blend_attachment_state,
+        {{1.0f, 1.0f, 1.0f, 1.0f}}
+    );
+
+    std::array<vk::DynamicState, 2> dynamic_states = {vk::DynamicState::eViewport, vk::DynamicState::eScissor};
+    vk::PipelineDynamicStateCreateInfo pipeline_dynamic_state_create_info(vk::PipelineDynamicStateCreateFlags(), dynamic_states);
+
+    vk::PipelineRenderingCreateInfo pipeline_rendering_create_info {};
+    pipeline_rendering_create_info.colorAttachmentCount = 1;
+    pipeline_rendering_create_info.pColorAttachmentFormats = &config.color_format;
+    pipeline_rendering_create_info.depthAttachmentFormat = config.depth_format;
+
+    vk::GraphicsPipelineCreateInfo graphics_pipeline_create_info(
+        vk::PipelineCreateFlags(),
+        pipeline_shader_stage_create_infos,
+        &pipeline_vertex_input_state_create_info,
+        &pipeline_input_assembly_state_create_info,
+        nullptr,
+        &pipeline_viewport_state_create_info,
+        &pipeline_rasterization_state_create_info,
+        &pipeline_multisample_state_create_info,
+        &pipeline_depth_stencil_state_create_info,
+        &pipeline_color_blend_state_create_info,
+        &pipeline_dynamic_state_create_info,
+        config.layout
+    );
+    vk::PipelineCreationFeedbackCreateInfo feedback_create_info(feedback);
+    if(feedback) {
+        pipeline_rendering_create_info.pNext = &feedback_create_info;
+    }
+    graphics_pipeline_create_info.pNext = &pipeline_rendering_create_info;
+
+    vk::Result result;
+    vk::Pipeline pipeline;
+    std::tie(result, pipeline) = config.device.createGraphicsPipeline(config.cache, graphics_pipeline_create_info);
+    switch(result) {
+        case vk::Result::eSuccess:
+            break;
+        case vk::Result::ePipelineCompileRequired:
+            break;
+        default:
+            std::cerr << "Something went wrong with graphics pipeline creation\n";
+            return {};
+    }
+
+    return pipeline;
+}
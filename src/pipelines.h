@@ -0,0 +1,84 @@
+#pragma once
+
+#include "vertex_format.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vulkan/vulkan.hpp>
+
+enum class BlendMode : uint8_t {
+    eOpaque,
+    eAlpha, // Straight alpha, for translucent overlays
+    eAdditive
+};
+
+// Everything that selects a graphics pipeline variant. point_size and alpha_scale are
+// specialization constants, point_size is constant_id 0 in test.vert, alpha_scale constant_id 1 in test.frag.
+// The vertex format sets the vertex input state and constant_id 2 and 3 in test.vert.
+struct PipelineKey {
+    vk::PrimitiveTopology topology = vk::PrimitiveTopology::eLineStrip;
+    VertexFormat format;
+    BlendMode blend = BlendMode::eOpaque;
+    bool depth_test = true;
+    bool depth_write = true;
+    float point_size = 1.0f;
+    float alpha_scale = 1.0f;
+
+    bool operator==(const PipelineKey& other) const;
+    bool operator!=(const PipelineKey& other) const { return !(*this == other); }
+};
+
+struct PipelineKeyHash {
+    size_t operator()(const PipelineKey& key) const;
+};
+
+// Builds pipeline variants on a background thread so a new render style never stalls the render loop.
+// Only the default variant is built upfront, it is what get() hands out while a variant with the same vertex format
+// and topology compiles. Other variants have no stand-in, the default one would draw their vertices wrong.
+class PipelineRegistry {
+public:
+    struct Config {
+        vk::Device device;
+        vk::PipelineCache cache;
+        vk::PipelineLayout layout;
+        vk::ShaderModule vertex_shader;
+        vk::ShaderModule fragment_shader;
+        vk::Format color_format;
+        vk::Format depth_format;
+        std::function<void()> on_ready; // Called on the compile thread after each variant it built, may be empty
+    };
+
+    PipelineRegistry() = default;
+    PipelineRegistry(const PipelineRegistry&) = delete;
+    PipelineRegistry& operator=(const PipelineRegistry&) = delete;
+    ~PipelineRegistry();
+
+    // Builds the default variant synchronously and starts the compile thread
+    void init(const Config& config, vk::PipelineCreationFeedback* feedback = nullptr);
+    void destroy();
+
+    // Returns the variant if it is ready, otherwise queues it for compilation and returns the default one, or a null
+    // handle when the variant's vertex format or topology differs from the default's. ready, when given, tells if it
+    // was the variant. Exits once a variant failed to build.
+    vk::Pipeline get(const PipelineKey& key, bool* ready = nullptr);
+
+private:
+    Config config {};
+    vk::Pipeline fallback {};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread worker;
+    bool stop = false;
+    bool failed = false; // A variant failed to build on the compile thread, the next get exits
+    std::deque<PipelineKey> queue;
+    std::unordered_set<PipelineKey, PipelineKeyHash> requested;
+    std::unordered_map<PipelineKey, vk::Pipeline, PipelineKeyHash> pipelines;
+
+    vk::Pipeline build(const PipelineKey& key, vk::PipelineCreationFeedback* feedback);
+    void compile_loop();
+};
@@ -0,0 +1,180 @@
+#include "profiler.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+// Trace thread ids, GPU phases get a row of their own under the CPU zones
+const int trace_cpu_tid = 1;
+const int trace_gpu_tid = 2;
+
+const char* zone_name(CpuZone zone) {
+    switch(zone) {
+        case CpuZone::eFenceWait:
+            return "fence wait";
+        case CpuZone::eUpload:
+            return "upload";
+        case CpuZone::eAcquire:
+            return "acquire";
+        case CpuZone::eRecord:
+            return "record";
+        case CpuZone::eSubmit:
+            return "submit";
+        case CpuZone::ePresent:
+            return "present";
+    }
+    return "";
+}
+
+const char* phase_name(GpuPhase phase) {
+    switch(phase) {
+        case GpuPhase::eBarriers:
+            return "barriers";
+        case GpuPhase::eRendering:
+            return "rendering";
+        case GpuPhase::ePresent:
+            return "present";
+    }
+    return "";
+}
+
+Profiler::Profiler(size_t capacity) : epoch(std::chrono::steady_clock::now()), records(std::max<size_t>(capacity, 1)) {}
+
+double Profiler::now() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Profiler::begin_frame(uint64_t frame) {
+    if(count == records.size()) {
+        first = (first + 1) % records.size();
+    } else {
+        ++count;
+    }
+    FrameRecord& record = current();
+    record = FrameRecord();
+    record.frame = frame;
+    record.start = now();
+    record.zone_start.fill(-1.0);
+}
+
+void Profiler::begin_zone(CpuZone zone) {
+    zone_begin[static_cast<size_t>(zone)] = now();
+}
+
+void Profiler::end_zone(CpuZone zone) {
+    if(count == 0) {
+        return;
+    }
+    size_t z = static_cast<size_t>(zone);
+    FrameRecord& record = current();
+    if(record.zone_start[z] < 0.0) {
+        record.zone_start[z] = std::max(zone_begin[z] - record.start, 0.0);
+    }
+    record.zone_seconds[z] += now() - zone_begin[z];
+}
+
+void Profiler::set_gpu_times(uint64_t frame, const std::array<double, gpu_phase_count>& seconds) {
+    // Frame numbers only grow, so the record is either at its distance from the newest one or gone
+    if(count == 0 || frame > current().frame || current().frame - frame >= count) {
+        return;
+    }
+    FrameRecord& record = records[(first + count - 1 - (current().frame - frame)) % records.size()];
+    if(record.frame != frame) {
+        return;
+    }
+    record.gpu_seconds = seconds;
+    record.gpu_valid = true;
+}
+
+// Complete ("X") events in microseconds. The GPU and host clocks are not calibrated against each other, so a frame's
+// GPU phases are drawn from its submit on: their durations are exact, where they start is only a lower bound.
+void Profiler::write_trace(std::ostream& out) const {
+    // Whole nanoseconds, the default six significant digits lose microseconds after ten seconds
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << trace_cpu_tid << ",\"args\":{\"name\":\"CPU\"}},\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << trace_gpu_tid << ",\"args\":{\"name\":\"GPU\"}}";
+    auto event = [&out](const char* name, int tid, double start, double seconds, uint64_t frame) {
+        out << ",\n{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid << ",\"ts\":" << start * 1e6
+            << ",\"dur\":" << seconds * 1e6 << ",\"args\":{\"frame\":" << frame << "}}";
+    };
+
+    for(size_t i = 0; i != count; ++i) {
+        const FrameRecord& r = record(i);
+        double end = 0.0;
+        for(size_t z = 0; z != cpu_zone_count; ++z) {
+            if(r.zone_start[z] >= 0.0) {
+                end = std::max(end, r.zone_start[z] + r.zone_seconds[z]);
+            }
+        }
+        event("frame", trace_cpu_tid, r.start, end, r.frame);
+        for(size_t z = 0; z != cpu_zone_count; ++z) {
+            if(r.zone_start[z] >= 0.0) {
+                event(zone_name(static_cast<CpuZone>(z)), trace_cpu_tid, r.start + r.zone_start[z], r.zone_seconds[z], r.frame);
+            }
+        }
+
+        if(!r.gpu_valid) {
+            continue;
+        }
+        size_t submit = static_cast<size_t>(CpuZone::eSubmit);
+        double gpu_start = r.start + std::max(r.zone_start[submit], 0.0);
+        for(size_t p = 0; p != gpu_phase_count; ++p) {
+            event(phase_name(static_cast<GpuPhase>(p)), trace_gpu_tid, gpu_start, r.gpu_seconds[p], r.frame);
+            gpu_start += r.gpu_seconds[p];
+        }
+    }
+    out << "\n]}\n";
+}
+
+void Profiler::write_csv(std::ostream& out) const {
+    out << std::fixed << std::setprecision(6); // Nanoseconds, in milliseconds
+    out << "zone,frames,mean_ms,min_ms,max_ms,p95_ms\n";
+    std::vector<double> samples;
+    auto row = [&out, &samples](const std::string& name) {
+        if(samples.empty()) {
+            out << name << ",0,,,,\n";
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        double sum = 0.0;
+        for(double s : samples) {
+            sum += s;
+        }
+        size_t p95 = std::min(samples.size() - 1, samples.size() * 95 / 100);
+        out << name << ',' << samples.size() << ',' << sum / samples.size() * 1e3 << ',' << samples.front() * 1e3 << ','
+            << samples.back() * 1e3 << ',' << samples[p95] * 1e3 << '\n';
+        samples.clear();
+    };
+
+    for(size_t z = 0; z != cpu_zone_count; ++z) {
+        for(size_t i = 0; i != count; ++i) {
+            if(record(i).zone_start[z] >= 0.0) {
+                samples.push_back(record(i).zone_seconds[z]);
+            }
+        }
+        row(zone_name(static_cast<CpuZone>(z)));
+    }
+    for(size_t p = 0; p != gpu_phase_count; ++p) {
+        for(size_t i = 0; i != count; ++i) {
+            if(record(i).gpu_valid) {
+                samples.push_back(record(i).gpu_seconds[p]);
+            }
+        }
+        row(std::string("gpu ") + phase_name(static_cast<GpuPhase>(p)));
+    }
+}
+
+void Profiler::save(const std::string& path) const {
+    std::ofstream os(path, std::ios::trunc);
+    if(!os.is_open()) {
+        std::cerr << "Could not write profile to " << path << "\n";
+        return;
+    }
+    bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    if(csv) {
+        write_csv(os);
+    } else {
+        write_trace(os);
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Host side steps of a frame, in the order the render loop runs them
+enum class CpuZone : uint8_t {
+    eFenceWait, // Blocked until the GPU is done with the frame slot's previous frame
+    eUpload,    // Camera, transforms, dirty vertices and draw commands written to mapped memory and the staging ring
+    eAcquire,   // Next swapchain image
+    eRecord,    // Command buffer recorded, or found up to date
+    eSubmit,
+    ePresent
+};
+const size_t cpu_zone_count = 6;
+
+// GPU side, between the timestamps every frame's command buffer writes
+enum class GpuPhase : uint8_t {
+    eBarriers,  // Uploads, culling and the layout transitions before rendering
+    eRendering, // beginRendering to endRendering
+    ePresent    // Transition for presenting or copying out, and the readback of exported frames
+};
+const size_t gpu_phase_count = 3;
+
+const char* zone_name(CpuZone zone);
+const char* phase_name(GpuPhase phase);
+
+struct FrameRecord {
+    uint64_t frame = 0;
+    double start = 0.0; // Seconds since the profiler was created
+    std::array<double, cpu_zone_count> zone_start {};   // Relative to start, when the frame first entered the zone, -1 if never
+    std::array<double, cpu_zone_count> zone_seconds {}; // Summed over every time it entered it
+    bool gpu_valid = false; // GPU times arrive frames_in_flight frames later, or never without timestamp support
+    std::array<double, gpu_phase_count> gpu_seconds {};
+};
+
+// Timings of the latest frames in a ring of records, written out as a Chrome trace_event file for chrome://tracing
+// or Perfetto, or as per zone statistics. Only the render loop's thread may use it.
+class Profiler {
+public:
+    explicit Profiler(size_t capacity = 1024);
+
+    // Starts a new record, overwriting the oldest once the ring is full
+    void begin_frame(uint64_t frame);
+    void begin_zone(CpuZone zone);
+    void end_zone(CpuZone zone);
+    // Ignored once the frame's record was overwritten
+    void set_gpu_times(uint64_t frame, const std::array<double, gpu_phase_count>& seconds);
+
+    // Oldest first
+    size_t size() const { return count; }
+    const FrameRecord& record(size_t i) const { return records[(first + i) % records.size()]; }
+
+    void write_trace(std::ostream& out) const;
+    // A row per zone and GPU phase: frames it appeared in, then mean, min, max and 95th percentile in milliseconds
+    void write_csv(std::ostream& out) const;
+    // CSV for paths ending in .csv, trace JSON otherwise
+    void save(const std::string& path) const;
+
+private:
+    std::chrono::steady_clock::time_point epoch;
+    std::array<double, cpu_zone_count> zone_begin {};
+    std::vector<FrameRecord> records;
+    size_t first = 0;
+    size_t count = 0;
+
+    double now() const;
+    FrameRecord& current() { return records[(first + count - 1) % records.size()]; }
+};
+
+// Times its scope as a zone of the profiler's current frame, does nothing without a profiler
+class ProfileZone {
+public:
+    ProfileZone(Profiler* profiler, CpuZone zone) : profiler(profiler), zone(zone) {
+        if(profiler) {
+            profiler->begin_zone(zone);
+        }
+    }
+    ~ProfileZone() {
+        if(profiler) {
+            profiler->end_zone(zone);
+        }
+    }
+    ProfileZone(const ProfileZone&) = delete;
+    ProfileZone& operator=(const ProfileZone&) = delete;
+
+private:
+    Profiler* profiler;
+    CpuZone zone;
+};
@@ -1,8 +1,17 @@
 #include "render.h"
+#include "soa.h"
+#include "jobs.h"
+#include "vertex_format.h"
 #include <algorithm>
 #include <limits>
 #include <glm/glm.hpp>
 #include <fstream>
+#include <cstring>
+#include <chrono>
+#include <cstdlib>
+#include <cstddef>
+#include <map>
+#include <mutex>
 
 const std::vector<const char*> validation_layers = {
     "VK_LAYER_KHRONOS_validation"
@@ -14,9 +23,26 @@ const std::vector<const char*> device_extensions = {
 
 const std::string vertex_shader_file = "test.vert.spv";
 const std::string fragment_shader_file = "test.frag.spv";
+const std::string cull_shader_file = "cull.comp.spv";
+const uint32_t cull_workgroup_size = 64; // Matches local_size_x in cull.comp
+// Fewer draw items than this per thread are recorded inline, a secondary command buffer is not worth it for them
+const size_t draw_items_per_chunk = 64;
+const std::string pipeline_cache_file = "pipeline_cache.bin";
+// Start of the frame, before rendering, after rendering and end of the frame, see GpuPhase
+const uint32_t timestamps_per_frame = gpu_phase_count + 1;
 
 const bool enable_validation_layers = true;
 
+const vk::DeviceSize initial_vertex_buffer_size = sizeof(Vertex) * 32768;
+const vk::DeviceSize initial_index_buffer_size = sizeof(uint32_t) * 65536;
+const vk::DeviceSize initial_object_buffer_size = sizeof(ObjectData) * 1024;
+const uint32_t initial_transform_capacity = 1024;
+const vk::DeviceSize staging_buffer_size = 8 * 1024 * 1024;
+// Dirty ranges of a dynamic object closer than this many vertices are uploaded as one
+const uint64_t dirty_merge_gap = 16;
+const size_t stream_vertices_per_job = 16384; // 512 KiB of vertices per parallel fill range
+const uint32_t initial_indirect_buffer_capacity = 1024; // Draw commands
+
 
 bool check_validation_layer_support() {
     std::vector<vk::LayerProperties> layers = vk::enumerateInstanceLayerProperties();
@@ -37,6 +63,75 @@ bool check_validation_layer_support() {
     return true;
 }
 
+void bounding_box(const std::vector<Vertex>& vertices, glm::vec3& min, glm::vec3& max) {
+    min = glm::vec3(vertices.front().position);
+    max = glm::vec3(vertices.front().position);
+    for(const auto& v : vertices) {
+        min = glm::min(min, glm::vec3(v.position));
+        max = glm::max(max, glm::vec3(v.position));
+    }
+}
+
+// Center of the axis aligned bounding box, radius reaching its furthest vertex
+glm::vec4 bounding_sphere(const std::vector<Vertex>& vertices) {
+    glm::vec3 min, max;
+    bounding_box(vertices, min, max);
+
+    glm::vec3 center = (min + max) * 0.5f;
+    float radius = 0.0f;
+    for(const auto& v : vertices) {
+        radius = std::max(radius, glm::length(glm::vec3(v.position) - center));
+    }
+    return glm::vec4(center, radius);
+}
+
+// Gribb-Hartmann extraction for a [0, 1] depth range, normals point inwards
+std::array<glm::vec4, 6> frustum_planes(const glm::mat4& m) {
+    glm::vec4 row[4];
+    for(int i = 0; i != 4; ++i) {
+        row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+    }
+
+    std::array<glm::vec4, 6> planes = {
+        row[3] + row[0],
+        row[3] - row[0],
+        row[3] + row[1],
+        row[3] - row[1],
+        row[2],
+        row[3] - row[2]
+    };
+    for(auto& plane : planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+    return planes;
+}
+
+// $XDG_CACHE_HOME/vk-anim, ~/.cache/vk-anim or the working directory if neither is set
+std::filesystem::path cache_directory() {
+    if(const char* xdg_cache = std::getenv("XDG_CACHE_HOME"); xdg_cache && *xdg_cache) {
+        return std::filesystem::path(xdg_cache) / "vk-anim";
+    }
+    if(const char* home = std::getenv("HOME"); home && *home) {
+        return std::filesystem::path(home) / ".cache" / "vk-anim";
+    }
+    return std::filesystem::current_path();
+}
+
+// Rejects anything that was not written by this driver on this device, drivers are not required to
+bool valid_pipeline_cache(const std::vector<char>& data, const vk::PhysicalDeviceProperties& properties) {
+    if(data.size() < sizeof(VkPipelineCacheHeaderVersionOne)) {
+        return false;
+    }
+
+    VkPipelineCacheHeaderVersionOne header;
+    memcpy(&header, data.data(), sizeof(header));
+    return header.headerSize >= sizeof(VkPipelineCacheHeaderVersionOne) &&
+        header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header.vendorID == properties.vendorID &&
+        header.deviceID == properties.deviceID &&
+        memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
+}
+
 vk::ShaderModule load_SPIRV_shader(const std::string& filename, vk::Device& device) {
     std::vector<uint32_t> shader_code;
     std::ifstream is(filename, std::ios::binary | std::ios::ate);
@@ -66,194 +161,767 @@ vk::ShaderModule load_SPIRV_shader(const std::string& filename, vk::Device& devi
     }
 }
 
-Render::Render(int width, int height, std::string name) : width(width), height(height), name(name) {
-    init_window();
+Render::Render(int width, int height, std::string name, uint32_t frames_in_flight, bool headless)
+    : width(width), height(height), name(name), headless(headless), frames_in_flight(std::max(1u, frames_in_flight)) {
+    if(!headless) {
+        init_window();
+    }
     init_vulkan();
-    init_swapchain();
+    if(headless) {
+        init_offscreen_targets();
+    } else {
+        init_swapchain();
+    }
     init_depth_buffer();
     init_uniform_buffer();
+    init_pipeline_cache();
     init_pipeline();
-    init_vertex_buffer();
+    init_growable_buffer(vertex_buffer, vk::BufferUsageFlagBits::eVertexBuffer, initial_vertex_buffer_size);
+    init_growable_buffer(index_buffer, vk::BufferUsageFlagBits::eIndexBuffer, initial_index_buffer_size);
+    init_growable_buffer(object_buffer, vk::BufferUsageFlagBits::eStorageBuffer, initial_object_buffer_size);
+    write_object_descriptor();
     init_command_buffer();
+    init_staging_buffer();
+    init_cull_pipeline();
+    init_indirect_buffer(initial_indirect_buffer_capacity);
+    init_transform_ring(initial_transform_capacity);
+    write_transform_descriptors();
+    init_sync_objects();
 }
 
-void Render::add_vobject(VObject v) {
-    if(free_vertex_mem_index >= 32 * 2048) {
-        std::cerr << "Increase vertex buffer size\n";
+ObjectHandle Render::add_vobject(const VObject& v, PipelineKey style) {
+    if(v.vertices.empty()) {
+        return {};
+    }
+
+    style = supported_style(style);
+    glm::vec3 min, max;
+    bounding_box(v.vertices, min, max);
+    uint64_t offset = allocate_vertices(style.format, v.vertices.size());
+    upload_vertices(style.format, offset, v.vertices.data(), v.vertices.size(), min, max);
+
+    RenderObject ro(offset / style.format.stride(), v.vertices.size(), bounding_sphere(v.vertices), style);
+    ro.object_slot = add_object_data(v.vertices.front().color, min, max);
+    ro.box_min = min;
+    ro.box_max = max;
+    if(draw_indirect_first_instance) {
+        glm::mat4 model(1.0f);
+        model[3] = glm::vec4(glm::vec3(v.position), 1.0f);
+        set_slot_transform(ro.object_slot, model);
+    }
+    return insert_object(ro);
+}
+
+ObjectHandle Render::add_samples(const float* x, const float* y, const float* z, size_t count, glm::vec4 color, PipelineKey style) {
+    if(count == 0) {
+        return {};
+    }
+
+    style = supported_style(style);
+    uint64_t offset = allocate_vertices(style.format, count);
+    glm::vec3 min(std::numeric_limits<float>::max());
+    glm::vec3 max(std::numeric_limits<float>::lowest());
+    // Quantized positions are relative to the box, so it has to be known before the first one is packed
+    if(style.format.position == PositionFormat::eQuantized16) {
+        for(size_t i = 0; i != count; ++i) {
+            min = glm::min(min, glm::vec3(x[i], y[i], z[i]));
+            max = glm::max(max, glm::vec3(x[i], y[i], z[i]));
+        }
+    }
+    std::mutex bounds_mutex;
+    stream_vertices(style.format, offset, count, min, max, [&](Vertex* out, size_t first, size_t n) {
+        glm::vec3 range_min(std::numeric_limits<float>::max());
+        glm::vec3 range_max(std::numeric_limits<float>::lowest());
+        soa_to_vertices(x + first, y + first, z + first, n, color, out, range_min, range_max);
+        std::lock_guard<std::mutex> lock(bounds_mutex);
+        min = glm::min(min, range_min);
+        max = glm::max(max, range_max);
+    });
+
+    // Sphere around the bounding box, slightly looser than bounding_sphere but free to compute while converting
+    glm::vec3 center = (min + max) * 0.5f;
+    glm::vec4 bounds(center, glm::length(max - center));
+    RenderObject ro(offset / style.format.stride(), count, bounds, style);
+    ro.object_slot = add_object_data(color, min, max);
+    ro.box_min = min;
+    ro.box_max = max;
+    return insert_object(ro);
+}
+
+ObjectHandle Render::add_vertices(size_t count, glm::vec4 bounds, const VertexFill& fill, PipelineKey style) {
+    if(count == 0) {
+        return {};
+    }
+
+    style = supported_style(style);
+    // The box around the bounding sphere, all quantization has to go on
+    glm::vec3 min = glm::vec3(bounds) - glm::vec3(bounds.w);
+    glm::vec3 max = glm::vec3(bounds) + glm::vec3(bounds.w);
+    uint64_t offset = allocate_vertices(style.format, count);
+    glm::vec4 color = stream_vertices(style.format, offset, count, min, max, fill);
+    RenderObject ro(offset / style.format.stride(), count, bounds, style);
+    ro.object_slot = add_object_data(color, min, max);
+    ro.box_min = min;
+    ro.box_max = max;
+    return insert_object(ro);
+}
+
+ObjectHandle Render::add_vsurface(const VSurface& surface, PipelineKey style) {
+    if(surface.vertices.empty() || surface.indices.empty()) {
+        return {};
+    }
+
+    style = supported_style(style);
+    glm::vec3 min, max;
+    bounding_box(surface.vertices, min, max);
+    uint64_t vertex_offset = allocate_vertices(style.format, surface.vertices.size());
+    upload_vertices(style.format, vertex_offset, surface.vertices.data(), surface.vertices.size(), min, max);
+
+    vk::DeviceSize index_size = sizeof(uint32_t) * surface.indices.size();
+    uint64_t index_offset = allocate_range(index_buffer, index_size, sizeof(uint32_t));
+    upload_to(index_buffer, index_offset, surface.indices.data(), index_size);
+
+    // The CPU copy of the vertices is not kept, bounds are all the renderer needs from them
+    RenderObject ro(vertex_offset / style.format.stride(), surface.vertices.size(), bounding_sphere(surface.vertices), style);
+    ro.first_index = index_offset / sizeof(uint32_t);
+    ro.index_count = surface.indices.size();
+    ro.object_slot = add_object_data(surface.color, min, max);
+    ro.box_min = min;
+    ro.box_max = max;
+    return insert_object(ro);
+}
+
+ObjectHandle Render::add_dynamic_vobject(VObject&& v, PipelineKey style) {
+    ObjectHandle handle = add_vobject(v, style);
+    if(handle.valid()) {
+        dynamic_vertices[handle.index] = DynamicVertices {std::move(v.vertices), DirtyRanges(dirty_merge_gap)};
+    }
+    return handle;
+}
+
+Vertex* Render::edit_vertices(ObjectHandle handle, size_t first, size_t count) {
+    RenderObject& ro = object(handle);
+    auto it = dynamic_vertices.find(handle.index);
+    if(it == dynamic_vertices.end()) {
+        std::cerr << "Object " << handle.index << " was not added with add_dynamic_vobject, its vertices can not be edited\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if(first + count > ro.vertex_count) {
+        std::cerr << "Vertex edit [" << first << ", " << first + count << ") is past the object's " << ro.vertex_count << " vertices\n";
         std::exit(EXIT_FAILURE);
     }
-    auto transfer_size = sizeof(Vertex) * v.vertices.size();
-    void* data = device.mapMemory(vertex_buffer.memory, free_vertex_mem_index, transfer_size); // TODO: update free_vertex_mem_index
-    memcpy(data, v.vertices.data(), transfer_size);
-    device.unmapMemory(vertex_buffer.memory);
 
-    render_objects.push_back(RenderObject(v, free_vertex_mem_index / sizeof(Vertex)));
-    free_vertex_mem_index += v.vertices.size();
+    DynamicVertices& dynamic = it->second;
+    if(dynamic.dirty.empty() && count != 0) {
+        dirty_objects.push_back(handle.index);
+    }
+    dynamic.dirty.add(first, count);
+    return dynamic.vertices.data() + first;
 }
 
-void Render::loop() {
-    image_acquired_semaphore = device.createSemaphore(vk::SemaphoreCreateInfo());
-    draw_fence = device.createFence(vk::FenceCreateInfo());
-    
-    while(!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+void Render::update_vertices(ObjectHandle handle, size_t first, const Vertex* vertices, size_t count) {
+    RenderObject& ro = object(handle);
+    if(first + count > ro.vertex_count) {
+        std::cerr << "Vertex update [" << first << ", " << first + count << ") is past the object's " << ro.vertex_count << " vertices\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if(count == 0) {
+        return;
+    }
+    if(dynamic_vertices.count(handle.index)) {
+        std::copy(vertices, vertices + count, edit_vertices(handle, first, count));
+        return;
+    }
 
-        vk::ResultValue<uint32_t> next_image = device.acquireNextImageKHR(swapchain.handle, 100000000, image_acquired_semaphore, nullptr);
-        if(next_image.result != vk::Result::eSuccess || next_image.value >= swapchain.image_views.size()) {
-            std::cerr << "Error with acquiring next image\n";
-            std::exit(EXIT_FAILURE);
+    // Frames in flight may be drawing these vertices, so even unified memory goes through a copy that is ordered after them
+    VertexFormat format = ro.style.format;
+    uint64_t offset = (uint64_t(ro.first_vertex) + first) * format.stride();
+    if(format == VertexFormat {}) {
+        upload_buffer(vertex_buffer.buffer, offset, vertices, sizeof(Vertex) * count);
+    } else {
+        std::vector<char> packed(size_t(format.stride()) * count);
+        pack_vertices(format, vertices, count, ro.box_min, ro.box_max - ro.box_min, packed.data());
+        upload_buffer(vertex_buffer.buffer, offset, packed.data(), packed.size());
+    }
+
+    // Grow the sphere to cover the new vertices, rebuilding it would take the vertices that were not updated
+    glm::vec3 center(ro.bounds);
+    float radius = ro.bounds.w;
+    for(size_t i = 0; i != count; ++i) {
+        radius = std::max(radius, glm::length(glm::vec3(vertices[i].position) - center));
+    }
+    if(radius != ro.bounds.w) {
+        ro.bounds.w = radius;
+        draw_commands_dirty = true;
+    }
+}
+
+void Render::set_transform(ObjectHandle handle, const glm::mat4& model) {
+    RenderObject& ro = object(handle);
+    if(!draw_indirect_first_instance) {
+        // Every draw would read slot 0's matrix
+        if(!warned_object_transforms) {
+            std::cerr << "drawIndirectFirstInstance is not supported, object transforms are ignored\n";
+            warned_object_transforms = true;
         }
-        uint32_t image_index = next_image.value;
-
-        command_buffer.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlags()));
-
-        std::array<vk::ClearValue, 2> clear_values;
-        clear_values[0].color = vk::ClearColorValue(0.5f, 0.2f, 0.2f, 0.2f);
-        clear_values[1].depthStencil = vk::ClearDepthStencilValue(1.0f, 0);
-
-        vk::RenderingAttachmentInfo color_attachment {};
-        color_attachment.imageView = swapchain.image_views[image_index];
-        color_attachment.imageLayout = vk::ImageLayout::eAttachmentOptimal;
-        color_attachment.loadOp = vk::AttachmentLoadOp::eClear;
-        color_attachment.storeOp = vk::AttachmentStoreOp::eStore;
-        color_attachment.clearValue = clear_values[0];
-
-        vk::RenderingAttachmentInfo depth_attachment {};
-        depth_attachment.imageView = depth_buffer.image_view;
-        depth_attachment.imageLayout = vk::ImageLayout::eDepthAttachmentOptimal;
-        depth_attachment.loadOp = vk::AttachmentLoadOp::eClear;
-        depth_attachment.storeOp = vk::AttachmentStoreOp::eStore;
-        depth_attachment.clearValue = clear_values[1];
-        
-
-        vk::RenderingInfo rendering_info {};
-        rendering_info.renderArea = vk::Rect2D({0, 0}, swapchain.extent);
-        rendering_info.layerCount = 1;
-        rendering_info.colorAttachmentCount = 1;
-        rendering_info.pColorAttachments = &color_attachment;
-        rendering_info.pDepthAttachment = &depth_attachment;
-
-        vk::ImageMemoryBarrier color_barrier {};
-        color_barrier.oldLayout = vk::ImageLayout::eUndefined;
-        color_barrier.newLayout = vk::ImageLayout::eColorAttachmentOptimal;
-        color_barrier.srcAccessMask = {};
-        color_barrier.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite;
-        color_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        color_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        color_barrier.image = swapchain.images[image_index];
-        color_barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-        color_barrier.subresourceRange.baseMipLevel = 0;
-        color_barrier.subresourceRange.levelCount = 1;
-        color_barrier.subresourceRange.baseArrayLayer = 0;
-        color_barrier.subresourceRange.layerCount = 1;
-
-        vk::ImageMemoryBarrier depth_barrier {};
-        depth_barrier.oldLayout = vk::ImageLayout::eUndefined;
-        depth_barrier.newLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
-        depth_barrier.srcAccessMask = {};
-        depth_barrier.dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
-        depth_barrier.image = depth_buffer.image;
-        depth_barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eDepth;
-        depth_barrier.subresourceRange.baseMipLevel = 0;
-        depth_barrier.subresourceRange.levelCount = 1;
-        depth_barrier.subresourceRange.baseArrayLayer = 0;
-        depth_barrier.subresourceRange.layerCount = 1;
-
-        std::array<vk::ImageMemoryBarrier, 2> barriers = {color_barrier, depth_barrier};
-
-        command_buffer.pipelineBarrier(
-            vk::PipelineStageFlagBits::eTopOfPipe,
-            vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests,
-            {},
-            nullptr,
-            nullptr,
-            barriers
-        );
+        return;
+    }
+    set_slot_transform(ro.object_slot, model);
+}
 
-        command_buffer.beginRendering(rendering_info);
+void Render::set_color(ObjectHandle handle, glm::vec4 color) {
+    RenderObject& ro = object(handle);
+    // Staged even on unified memory, frames in flight may still read the old color
+    upload_buffer(object_buffer.buffer, uint64_t(ro.object_slot) * sizeof(ObjectData) + offsetof(ObjectData, color), &color, sizeof(color));
+}
 
-        command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
-        command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline_layout, 0, descriptor_set, nullptr);
-        command_buffer.bindVertexBuffers(0, vertex_buffer.buffer, {0});
-        command_buffer.setViewport(
-            0, 
-            vk::Viewport(0.0f, 0.0f, static_cast<float>(swapchain.extent.width), static_cast<float>(swapchain.extent.height), 0.0f, 1.0f)
-        );
-        command_buffer.setScissor(0, vk::Rect2D(vk::Offset2D(0, 0), swapchain.extent));
-
-        for(auto ro : render_objects) {
-            command_buffer.draw(ro.vobject.vertices.size(), 1, ro.first_vertex, 0);
-        }
-
-        command_buffer.endRendering();
-
-        vk::ImageMemoryBarrier present_barrier {};
-        present_barrier.oldLayout = vk::ImageLayout::eColorAttachmentOptimal;
-        present_barrier.newLayout = vk::ImageLayout::ePresentSrcKHR;
-        present_barrier.srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite;
-        present_barrier.dstAccessMask = {};
-        present_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        present_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        present_barrier.image = swapchain.images[image_index];
-        present_barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-        present_barrier.subresourceRange.baseMipLevel = 0;
-        present_barrier.subresourceRange.levelCount = 1;
-        present_barrier.subresourceRange.baseArrayLayer = 0;
-        present_barrier.subresourceRange.layerCount = 1;
-
-        command_buffer.pipelineBarrier(
-            vk::PipelineStageFlagBits::eColorAttachmentOutput,
-            vk::PipelineStageFlagBits::eBottomOfPipe,
-            {},
-            nullptr,
-            nullptr,
-            present_barrier
-        );
+void Render::set_frame_callback(std::function<void(double seconds)> callback) {
+    frame_callback = std::move(callback);
+}
+
+void Render::set_on_demand(bool enabled, double wake_interval) {
+    on_demand = enabled;
+    idle_wake_interval = wake_interval;
+}
+
+void Render::request_frame() {
+    frame_requested = true;
+    if(!headless) {
+        glfwPostEmptyEvent();
+    }
+}
+
+LoopStats Render::get_loop_stats() const {
+    return loop_stats;
+}
+
+// Transform and camera changes set frame_requested, everything else that changes the image leaves work behind
+bool Render::frame_damaged() const {
+    return frame_requested || draw_commands_dirty || !staging.pending.empty() || !dirty_objects.empty();
+}
+
+void Render::set_camera(const glm::mat4& new_view, const glm::mat4& new_projection) {
+    view = new_view;
+    projection = new_projection;
+    view_projection = projection * view;
+    frame_requested = true;
+    // The culling pass has the frustum planes in its push constants
+    if(gpu_culling) {
+        invalidate_command_buffers();
+    }
+}
+
+void Render::remove(ObjectHandle handle) {
+    RenderObject& ro = object(handle);
+    ro.alive = false;
+    ++ro.generation;
+    dynamic_vertices.erase(handle.index);
+    free_object_slots.push_back(handle.index);
+    draw_commands_dirty = true;
+
+    // The next frame no longer draws the object, but it still records the staging copies pending for its ranges
+    uint64_t last_frame = frames_submitted;
+    range_releases.push_back({last_frame, &vertex_buffer.ranges, uint64_t(ro.first_vertex) * ro.style.format.stride()});
+    if(ro.index_count != 0) {
+        range_releases.push_back({last_frame, &index_buffer.ranges, uint64_t(ro.first_index) * sizeof(uint32_t)});
+    }
+    range_releases.push_back({last_frame, &object_buffer.ranges, uint64_t(ro.object_slot) * sizeof(ObjectData)});
+}
+
+ObjectHandle Render::insert_object(RenderObject ro) {
+    ro.alive = true;
+    draw_commands_dirty = true;
+    if(free_object_slots.empty()) {
+        render_objects.push_back(ro);
+        return {static_cast<uint32_t>(render_objects.size() - 1), 0};
+    }
+
+    uint32_t index = free_object_slots.back();
+    free_object_slots.pop_back();
+    ro.generation = render_objects[index].generation;
+    render_objects[index] = ro;
+    return {index, ro.generation};
+}
+
+RenderObject& Render::object(ObjectHandle handle) {
+    if(handle.index >= render_objects.size() || !render_objects[handle.index].alive ||
+        render_objects[handle.index].generation != handle.generation) {
+        std::cerr << "Invalid object handle " << handle.index << ", generation " << handle.generation << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+    return render_objects[handle.index];
+}
+
+// Packs each dirty range of the dynamic objects straight into the staging ring, adjacent ranges
+// end up adjacent in both buffers and record_uploads merges their copies
+void Render::flush_dirty_vertices() {
+    for(uint32_t index : dirty_objects) {
+        auto it = dynamic_vertices.find(index);
+        if(it == dynamic_vertices.end()) {
+            continue; // Removed since it was edited
+        }
+        RenderObject& ro = render_objects[index];
+        DynamicVertices& dynamic = it->second;
+        VertexFormat format = ro.style.format;
+        uint32_t stride = format.stride();
+        size_t chunk_vertices = staging.size / stride;
+
+        glm::vec3 center(ro.bounds);
+        float radius = ro.bounds.w;
+        for(const auto& [first, end] : dynamic.dirty.get()) {
+            for(uint64_t i = first; i < end; i += chunk_vertices) {
+                size_t n = std::min<uint64_t>(chunk_vertices, end - i);
+                vk::DeviceSize staging_offset = allocate_staging(n * stride);
+                pack_vertices(
+                    format, dynamic.vertices.data() + i, n, ro.box_min, ro.box_max - ro.box_min, staging.memory.mapped + staging_offset
+                );
+                vk::DeviceSize dst_offset = (ro.first_vertex + i) * stride;
+                staging.pending.push_back({vertex_buffer.buffer, vk::BufferCopy(staging_offset, dst_offset, n * stride)});
+            }
+            for(uint64_t i = first; i != end; ++i) {
+                radius = std::max(radius, glm::length(glm::vec3(dynamic.vertices[i].position) - center));
+            }
+        }
+        if(radius != ro.bounds.w) {
+            ro.bounds.w = radius;
+            draw_commands_dirty = true;
+        }
+        dynamic.dirty.clear();
+    }
+    dirty_objects.clear();
+}
+
+// Called once the fence of frame frames_submitted - frames_in_flight has been waited for
+void Render::release_ranges() {
+    while(!range_releases.empty()) {
+        const RangeRelease& release = range_releases.front();
+        if(release.last_frame + frames_in_flight > frames_submitted) {
+            break;
+        }
+        release.ranges->free(release.offset);
+        range_releases.pop_front();
+    }
+}
+
+void Render::export_frames(const std::string& target, ExportFormat format, uint32_t fps) {
+    if(!swapchain.transfer_src) {
+        std::cerr << "Swapchain images can not be copied from, frames can not be exported\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    // One more slot than frames in flight, so the writer always has a frame to work on while the GPU renders
+    exporter = std::make_unique<FrameExporter>(
+        device, allocator, swapchain.extent, swapchain.format, target, format, fps, frames_in_flight + 1
+    );
+    export_frame_time = 1.0 / fps;
+}
+
+void Render::print_vertex_buffer_stats() {
+    std::cout << "Vertex buffer: " << vertex_buffer.ranges.used() << " / " << vertex_buffer.size << " bytes used, "
+              << vertex_buffer.ranges.allocation_count() << " allocations, "
+              << vertex_buffer.ranges.free_range_count() << " free ranges (largest "
+              << vertex_buffer.ranges.largest_free_range() << " bytes), fragmentation "
+              << vertex_buffer.ranges.fragmentation() << "\n";
+}
+
+void Render::loop(uint64_t frame_count) {
+    auto previous_frame = std::chrono::steady_clock::now();
+    // On demand, only idle right after a frame that was not drawn, so animations keep their frame rate
+    bool on_demand_loop = on_demand && !headless;
+    bool drew_last = true;
+    for(uint64_t frame_number = 0; frame_count == 0 || frame_number != frame_count;) {
+        if(!headless) {
+            if(glfwWindowShouldClose(window)) {
+                break;
+            }
+            if(on_demand_loop && !drew_last && !frame_damaged()) {
+                auto idle_start = std::chrono::steady_clock::now();
+                if(idle_wake_interval > 0.0) {
+                    glfwWaitEventsTimeout(idle_wake_interval);
+                } else {
+                    glfwWaitEvents();
+                }
+                std::chrono::duration<double> idle = std::chrono::steady_clock::now() - idle_start;
+                loop_stats.idle_seconds += idle.count();
+            } else {
+                glfwPollEvents();
+            }
+        }
+
+        if(frame_callback) {
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> elapsed = now - previous_frame;
+            previous_frame = now;
+            frame_callback(exporter ? export_frame_time : elapsed.count());
+        }
+        if(on_demand_loop && !frame_damaged()) {
+            ++loop_stats.idle_wakes;
+            drew_last = false;
+            continue;
+        }
+        frame_requested = false;
+        drew_last = true;
+        ++frame_number;
+        ++loop_stats.frames;
+
+        Frame& frame = frames[current_frame];
+        if(profiler) {
+            profiler->begin_frame(frame_number);
+        }
+
+        // Only blocks if the GPU is still frames_in_flight frames behind
+        {
+            ProfileZone zone(profiler.get(), CpuZone::eFenceWait);
+            while(vk::Result::eTimeout == device.waitForFences(frame.in_flight_fence, VK_TRUE, 100000000))
+                ;
+        }
+        read_timestamps(frame);
+        staging.tail = std::max(staging.tail, frame.staging_head);
+        release_ranges();
+        {
+            ProfileZone zone(profiler.get(), CpuZone::eUpload);
+            write_frame_data();
+        }
+
+        // Offscreen images belong to a frame slot, the frame fence already guards their reuse
+        uint32_t image_index = current_frame;
+        if(!headless) {
+            ProfileZone zone(profiler.get(), CpuZone::eAcquire);
+            vk::ResultValue<uint32_t> next_image = device.acquireNextImageKHR(swapchain.handle, 100000000, frame.image_acquired_semaphore, nullptr);
+            if(next_image.result != vk::Result::eSuccess || next_image.value >= swapchain.image_views.size()) {
+                std::cerr << "Error with acquiring next image\n";
+                std::exit(EXIT_FAILURE);
+            }
+            image_index = next_image.value;
+        }
 
-        command_buffer.end();
+        device.resetFences(frame.in_flight_fence);
+
+        {
+            ProfileZone zone(profiler.get(), CpuZone::eUpload);
+            flush_dirty_vertices();
+            update_draw_commands();
+        }
+
+        // Uploads and readbacks differ from frame to frame, a command buffer with them is recorded again next time
+        bool reusable = staging.pending.empty() && !exporter;
+        vk::CommandBuffer command_buffer = frame.command_buffers[image_index];
+        uint64_t& recorded = frame.recorded_generation[image_index];
+        {
+            ProfileZone zone(profiler.get(), CpuZone::eRecord);
+            if(reusable && recorded == command_generation) {
+                ++command_buffer_stats.reused;
+            } else {
+                command_buffer.reset();
+                command_buffer.begin(vk::CommandBufferBeginInfo(reusable ? vk::CommandBufferUsageFlags() : vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+                bool complete = record_frame(command_buffer, image_index);
+                command_buffer.end();
+                recorded = reusable && complete ? command_generation : 0;
+                ++command_buffer_stats.recorded;
+            }
+        }
+        frame.staging_head = staging.head;
+        if(timestamp_pool) {
+            frame.timed_frame = frame_number;
+        }
+
+        if(headless) {
+            {
+                ProfileZone zone(profiler.get(), CpuZone::eSubmit);
+                graphics_queue.submit(vk::SubmitInfo({}, {}, command_buffer, {}), frame.in_flight_fence);
+            }
+            ++frames_submitted;
+            if(exporter) {
+                exporter->end_frame(graphics_queue);
+            }
+            current_frame = (current_frame + 1) % frames_in_flight;
+            continue;
+        }
 
         vk::PipelineStageFlags wait_dst_stage_mask(vk::PipelineStageFlagBits::eColorAttachmentOutput);
-        vk::SubmitInfo submit_info(image_acquired_semaphore, wait_dst_stage_mask, command_buffer);
-        graphics_queue.submit(submit_info, draw_fence);
+        vk::Semaphore render_finished = render_finished_semaphores[image_index];
+        vk::SubmitInfo submit_info(frame.image_acquired_semaphore, wait_dst_stage_mask, command_buffer, render_finished);
+        {
+            ProfileZone zone(profiler.get(), CpuZone::eSubmit);
+            graphics_queue.submit(submit_info, frame.in_flight_fence);
+        }
+        ++frames_submitted;
+        if(exporter) {
+            exporter->end_frame(graphics_queue);
+        }
 
-        while(vk::Result::eTimeout == device.waitForFences(draw_fence, VK_TRUE, 100000000))
-            ;
-        device.resetFences(draw_fence);
-        vk::Result result = graphics_queue.presentKHR(vk::PresentInfoKHR({}, swapchain.handle, image_index));
+        // Presentation waits on the GPU, not the host
+        vk::Result result;
+        {
+            ProfileZone zone(profiler.get(), CpuZone::ePresent);
+            result = graphics_queue.presentKHR(vk::PresentInfoKHR(render_finished, swapchain.handle, image_index));
+        }
         if(result != vk::Result::eSuccess) {
             std::cout << "Image present was not a success\n";
         }
 
-        command_buffer.reset();
+        current_frame = (current_frame + 1) % frames_in_flight;
     }
+
+    device.waitIdle();
+    // Nothing is in flight anymore
+    for(const RangeRelease& release : range_releases) {
+        release.ranges->free(release.offset);
+    }
+    range_releases.clear();
+}
+
+// Everything the frame runs on the GPU, from the uploads to the readback. Returns false when a draw group had to use
+// the default pipeline, or was left out, while its own compiles, the commands are then out of date as soon as it is
+// ready.
+bool Render::record_frame(vk::CommandBuffer command_buffer, uint32_t image_index) {
+    // Reset on every submit, so command buffers reused as they are keep timing their frame
+    uint32_t first_timestamp = current_frame * timestamps_per_frame;
+    if(timestamp_pool) {
+        command_buffer.resetQueryPool(timestamp_pool, first_timestamp, timestamps_per_frame);
+        command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, timestamp_pool, first_timestamp);
+    }
+    record_uploads(command_buffer);
+    record_culling(command_buffer);
+
+    std::array<vk::ClearValue, 2> clear_values;
+    clear_values[0].color = vk::ClearColorValue(0.5f, 0.2f, 0.2f, 0.2f);
+    clear_values[1].depthStencil = vk::ClearDepthStencilValue(1.0f, 0);
+
+    vk::RenderingAttachmentInfo color_attachment {};
+    color_attachment.imageView = swapchain.image_views[image_index];
+    color_attachment.imageLayout = vk::ImageLayout::eAttachmentOptimal;
+    color_attachment.loadOp = vk::AttachmentLoadOp::eClear;
+    color_attachment.storeOp = vk::AttachmentStoreOp::eStore;
+    color_attachment.clearValue = clear_values[0];
+
+    vk::RenderingAttachmentInfo depth_attachment {};
+    depth_attachment.imageView = depth_buffer.image_view;
+    depth_attachment.imageLayout = vk::ImageLayout::eDepthAttachmentOptimal;
+    depth_attachment.loadOp = vk::AttachmentLoadOp::eClear;
+    depth_attachment.storeOp = vk::AttachmentStoreOp::eStore;
+    depth_attachment.clearValue = clear_values[1];
+    
+
+    vk::RenderingInfo rendering_info {};
+    rendering_info.renderArea = vk::Rect2D({0, 0}, swapchain.extent);
+    rendering_info.layerCount = 1;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachments = &color_attachment;
+    rendering_info.pDepthAttachment = &depth_attachment;
+
+    vk::ImageMemoryBarrier color_barrier {};
+    color_barrier.oldLayout = vk::ImageLayout::eUndefined;
+    color_barrier.newLayout = vk::ImageLayout::eColorAttachmentOptimal;
+    color_barrier.srcAccessMask = {};
+    color_barrier.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite;
+    color_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    color_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    color_barrier.image = swapchain.images[image_index];
+    color_barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+    color_barrier.subresourceRange.baseMipLevel = 0;
+    color_barrier.subresourceRange.levelCount = 1;
+    color_barrier.subresourceRange.baseArrayLayer = 0;
+    color_barrier.subresourceRange.layerCount = 1;
+
+    vk::ImageMemoryBarrier depth_barrier {};
+    depth_barrier.oldLayout = vk::ImageLayout::eUndefined;
+    depth_barrier.newLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+    // The depth buffer is shared between frames in flight, wait for the previous frame's writes
+    depth_barrier.srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    depth_barrier.dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    depth_barrier.image = depth_buffer.image;
+    depth_barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eDepth;
+    depth_barrier.subresourceRange.baseMipLevel = 0;
+    depth_barrier.subresourceRange.levelCount = 1;
+    depth_barrier.subresourceRange.baseArrayLayer = 0;
+    depth_barrier.subresourceRange.layerCount = 1;
+
+    std::array<vk::ImageMemoryBarrier, 2> barriers = {color_barrier, depth_barrier};
+
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eLateFragmentTests,
+        vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests,
+        {},
+        nullptr,
+        nullptr,
+        barriers
+    );
+
+    if(timestamp_pool) {
+        command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, timestamp_pool, first_timestamp + 1);
+    }
+
+    bool complete = true;
+    uint32_t draw_chunks = record_draw_chunks(complete);
+    if(draw_chunks) {
+        rendering_info.flags = vk::RenderingFlagBits::eContentsSecondaryCommandBuffers;
+    }
+    command_buffer.beginRendering(rendering_info);
+
+    if(draw_chunks) {
+        const Frame& frame = frames[current_frame];
+        command_buffer.executeCommands(draw_chunks, frame.draw_buffers.data());
+    } else {
+        bind_draw_state(command_buffer);
+        complete = record_draws(command_buffer, 0, draw_items.size());
+    }
+
+    command_buffer.endRendering();
+    if(timestamp_pool) {
+        command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, timestamp_pool, first_timestamp + 2);
+    }
+
+    // Offscreen images, and images about to be exported, are left ready to be copied out
+    bool copy_out = headless || exporter;
+    vk::ImageMemoryBarrier present_barrier {};
+    present_barrier.oldLayout = vk::ImageLayout::eColorAttachmentOptimal;
+    present_barrier.newLayout = copy_out ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR;
+    present_barrier.srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite;
+    present_barrier.dstAccessMask = copy_out ? vk::AccessFlagBits::eTransferRead : vk::AccessFlags();
+    present_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    present_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    present_barrier.image = swapchain.images[image_index];
+    present_barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+    present_barrier.subresourceRange.baseMipLevel = 0;
+    present_barrier.subresourceRange.levelCount = 1;
+    present_barrier.subresourceRange.baseArrayLayer = 0;
+    present_barrier.subresourceRange.layerCount = 1;
+
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        copy_out ? vk::PipelineStageFlagBits::eTransfer : vk::PipelineStageFlagBits::eBottomOfPipe,
+        {},
+        nullptr,
+        nullptr,
+        present_barrier
+    );
+
+    if(exporter) {
+        record_readback(command_buffer, swapchain.images[image_index]);
+    }
+    if(timestamp_pool) {
+        command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, timestamp_pool, first_timestamp + 3);
+    }
+
+    return complete;
+}
+
+// The queue writes timestamps only with some queue families and devices, without them only CPU zones are timed
+void Render::enable_profiling(size_t frame_capacity) {
+    profiler = std::make_unique<Profiler>(frame_capacity);
+    if(timestamp_pool) {
+        return;
+    }
+
+    auto physical_device = instance.enumeratePhysicalDevices().front(); // May be dangerous (deterministic?)
+    uint32_t valid_bits = physical_device.getQueueFamilyProperties()[graphics_qf_index].timestampValidBits;
+    if(valid_bits == 0) {
+        std::cout << "Queue does not support timestamps, GPU phases are not timed\n";
+        return;
+    }
+    timestamp_mask = valid_bits == 64 ? ~0ull : (1ull << valid_bits) - 1;
+    timestamp_period = physical_device.getProperties().limits.timestampPeriod;
+    timestamp_pool = device.createQueryPool(
+        vk::QueryPoolCreateInfo({}, vk::QueryType::eTimestamp, frames_in_flight * timestamps_per_frame)
+    );
+    for(Frame& frame : frames) {
+        frame.timed_frame = 0;
+    }
+    // Recorded command buffers have no timestamps yet
+    invalidate_command_buffers();
+}
+
+const Profiler* Render::get_profiler() const {
+    return profiler.get();
+}
+
+// Call once the frame's fence signaled, its timestamps are then available
+void Render::read_timestamps(Frame& frame) {
+    if(!timestamp_pool || frame.timed_frame == 0) {
+        return;
+    }
+    vk::ResultValue<std::vector<uint64_t>> timestamps = device.getQueryPoolResults<uint64_t>(
+        timestamp_pool, current_frame * timestamps_per_frame, timestamps_per_frame,
+        timestamps_per_frame * sizeof(uint64_t), sizeof(uint64_t), vk::QueryResultFlagBits::e64
+    );
+    if(timestamps.result == vk::Result::eSuccess) {
+        std::array<double, gpu_phase_count> seconds;
+        for(uint32_t p = 0; p != gpu_phase_count; ++p) {
+            uint64_t ticks = (timestamps.value[p + 1] - timestamps.value[p]) & timestamp_mask;
+            seconds[p] = ticks * timestamp_period * 1e-9;
+        }
+        profiler->set_gpu_times(frame.timed_frame, seconds);
+    }
+    frame.timed_frame = 0;
 }
 
 Render::~Render() {
+    device.waitIdle();
 
-    device.destroyFence(draw_fence);
-    device.destroySemaphore(image_acquired_semaphore);
+    // Writes out the frames still in the readback ring
+    exporter.reset();
+
+    for(auto& frame : frames) {
+        device.destroyFence(frame.in_flight_fence);
+        device.destroySemaphore(frame.image_acquired_semaphore);
+        for(vk::CommandPool pool : frame.draw_pools) {
+            device.destroyCommandPool(pool);
+        }
+    }
+    for(auto& semaphore : render_finished_semaphores) {
+        device.destroySemaphore(semaphore);
+    }
     device.destroyCommandPool(command_pool);
-    device.destroyBuffer(vertex_buffer.buffer);
-    device.freeMemory(vertex_buffer.memory);
-    device.destroyPipeline(pipeline);
+    if(timestamp_pool) {
+        device.destroyQueryPool(timestamp_pool);
+    }
+    destroy_indirect_buffer();
+    if(gpu_culling) {
+        device.destroyPipeline(cull.pipeline);
+        device.destroyPipelineLayout(cull.pipeline_layout);
+        device.destroyDescriptorPool(cull.descriptor_pool);
+        device.destroyDescriptorSetLayout(cull.descriptor_set_layout);
+    }
+    device.destroyBuffer(staging.buffer);
+    allocator.free(staging.memory);
+    destroy_transform_ring();
+    destroy_growable_buffer(object_buffer);
+    destroy_growable_buffer(index_buffer);
+    destroy_growable_buffer(vertex_buffer);
+    pipelines.destroy();
+    save_pipeline_cache();
+    device.destroyPipelineCache(pipeline_cache);
     device.destroyPipelineLayout(pipeline_layout);
     device.freeDescriptorSets(descriptor_pool, descriptor_set);
     device.destroyDescriptorPool(descriptor_pool);
     device.destroyDescriptorSetLayout(descriptor_set_layout);
     device.destroyBuffer(uniform_buffer.buffer);
-    device.freeMemory(uniform_buffer.memory);
+    allocator.free(uniform_buffer.memory);
     device.destroyImageView(depth_buffer.image_view);
     device.destroyImage(depth_buffer.image);
-    device.freeMemory(depth_buffer.memory);
+    allocator.free(depth_buffer.memory);
     for(auto& iv : swapchain.image_views) {
         device.destroyImageView(iv);
     }
-    device.destroySwapchainKHR(swapchain.handle);
+    if(headless) {
+        for(uint32_t i = 0; i != swapchain.images.size(); ++i) {
+            device.destroyImage(swapchain.images[i]);
+            allocator.free(swapchain.offscreen_memory[i]);
+        }
+    } else {
+        device.destroySwapchainKHR(swapchain.handle);
+    }
+    allocator.destroy();
     device.destroy();
-    instance.destroySurfaceKHR(surface);
+    if(!headless) {
+        instance.destroySurfaceKHR(surface);
+    }
     instance.destroy();
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if(!headless) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
 }
 
 void Render::init_window() {
@@ -263,24 +931,38 @@ void Render::init_window() {
     glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
 
     window = glfwCreateWindow(width, height, name.c_str(), nullptr, nullptr);
+    // Parts of the window were uncovered, on demand rendering has to draw them again
+    glfwSetWindowUserPointer(window, this);
+    glfwSetWindowRefreshCallback(window, [](GLFWwindow* w) {
+        static_cast<Render*>(glfwGetWindowUserPointer(w))->frame_requested = true;
+    });
 }
 
 void Render::init_vulkan() {
-    if(enable_validation_layers && !check_validation_layer_support()) {
-        std::cerr << "No validation layer support\n";
-        std::exit(EXIT_FAILURE);
+    // Batch machines often only have a software ICD installed, headless rendering goes on without the layers there
+    bool validation = enable_validation_layers;
+    if(validation && !check_validation_layer_support()) {
+        if(!headless) {
+            std::cerr << "No validation layer support\n";
+            std::exit(EXIT_FAILURE);
+        }
+        std::cerr << "No validation layer support, continuing without validation\n";
+        validation = false;
     }
 
     vk::ApplicationInfo app_info(name.c_str(), 1, name.c_str(), 1, VK_API_VERSION_1_3);
     vk::InstanceCreateInfo instance_info({}, &app_info);
-    if(enable_validation_layers) {
+    if(validation) {
         instance_info.enabledLayerCount = validation_layers.size();
         instance_info.ppEnabledLayerNames = validation_layers.data();
     }
-    uint32_t glfw_extensions_count = 0;
-    auto glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extensions_count);
-    instance_info.enabledExtensionCount = glfw_extensions_count;
-    instance_info.ppEnabledExtensionNames = glfw_extensions;
+    // Headless rendering needs no surface extensions, so GLFW is never initialized
+    if(!headless) {
+        uint32_t glfw_extensions_count = 0;
+        auto glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extensions_count);
+        instance_info.enabledExtensionCount = glfw_extensions_count;
+        instance_info.ppEnabledExtensionNames = glfw_extensions;
+    }
 
     instance = vk::createInstance(instance_info);
 
@@ -297,22 +979,62 @@ void Render::init_vulkan() {
     vk::DeviceQueueCreateInfo queue_info(vk::DeviceQueueCreateFlags(), static_cast<uint32_t>(graphics_qf_index), 1, &queue_priority);
     auto available_extensions = phys_device.enumerateDeviceExtensionProperties();
     bool swapchain_support = false;
+    bool memory_budget_support = false;
     for(auto extension : available_extensions) {
         if(std::string(extension.extensionName) == std::string(VK_KHR_SWAPCHAIN_EXTENSION_NAME)) {
             swapchain_support = true;
         }
+        if(std::string(extension.extensionName) == std::string(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+            memory_budget_support = true;
+        }
     }
-    if(swapchain_support == false) {
+    if(!headless && swapchain_support == false) {
         std::cerr << "Swapchain extension not supported by device\n";
         std::exit(EXIT_FAILURE);
     }
     vk::PhysicalDeviceDynamicRenderingFeatures dynamic_rendering_features = {};
     dynamic_rendering_features.setDynamicRendering(VK_TRUE);
-    auto device_info = vk::DeviceCreateInfo(vk::DeviceCreateFlags(), queue_info, {}, device_extensions);
+
+    // Without multiDrawIndirect every draw command is submitted with its own drawIndirect
+    vk::PhysicalDeviceFeatures supported_features = phys_device.getFeatures();
+    vk::PhysicalDeviceFeatures enabled_features {};
+    enabled_features.multiDrawIndirect = supported_features.multiDrawIndirect;
+    multi_draw_indirect = supported_features.multiDrawIndirect;
+    enabled_features.drawIndirectFirstInstance = supported_features.drawIndirectFirstInstance;
+    draw_indirect_first_instance = supported_features.drawIndirectFirstInstance;
+    max_draw_indirect_count = multi_draw_indirect ? phys_device.getProperties().limits.maxDrawIndirectCount : 1;
+
+    auto supported_features12 = phys_device.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceVulkan12Features>();
+    vk::PhysicalDeviceVulkan12Features vulkan12_features {};
+    vulkan12_features.drawIndirectCount = supported_features12.get<vk::PhysicalDeviceVulkan12Features>().drawIndirectCount;
+    gpu_culling = vulkan12_features.drawIndirectCount;
+    dynamic_rendering_features.pNext = &vulkan12_features;
+
+    std::vector<const char*> enabled_extensions;
+    if(!headless) {
+        enabled_extensions = device_extensions;
+    }
+    if(memory_budget_support) {
+        enabled_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    }
+    auto device_info = vk::DeviceCreateInfo(vk::DeviceCreateFlags(), queue_info, {}, enabled_extensions);
     device_info.pNext = &dynamic_rendering_features;
+    device_info.pEnabledFeatures = &enabled_features;
     device = phys_device.createDevice(device_info);
 
     graphics_queue = device.getQueue(graphics_qf_index, 0);
+    allocator = DeviceAllocator(phys_device, device, memory_budget_support);
+
+    vk::PhysicalDeviceType device_type = phys_device.getProperties().deviceType;
+    if(device_type == vk::PhysicalDeviceType::eIntegratedGpu || device_type == vk::PhysicalDeviceType::eCpu) {
+        unified_memory = allocator.has_memory_type(
+            vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent
+        );
+    }
+
+    if(headless) {
+        return;
+    }
 
     {
         VkSurfaceKHR _surface;
@@ -364,6 +1086,13 @@ void Render::init_swapchain() {
         image_count = std::clamp(3u, surface_capabilities.minImageCount, surface_capabilities.maxImageCount);
     }
 
+    // Transfer source is only needed to export frames, but costs nothing where it is supported
+    vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eColorAttachment;
+    swapchain.transfer_src = static_cast<bool>(surface_capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eTransferSrc);
+    if(swapchain.transfer_src) {
+        usage |= vk::ImageUsageFlagBits::eTransferSrc;
+    }
+
     vk::SwapchainCreateInfoKHR create_info(
         vk::SwapchainCreateFlagsKHR(),
         surface,
@@ -372,7 +1101,7 @@ void Render::init_swapchain() {
         vk::ColorSpaceKHR::eSrgbNonlinear,
         swapchain.extent,
         1,
-        vk::ImageUsageFlagBits::eColorAttachment,
+        usage,
         vk::SharingMode::eExclusive,
         {},
         pre_transform,
@@ -392,6 +1121,34 @@ void Render::init_swapchain() {
     }
 }
 
+// Stands in for the swapchain in headless mode, one color image per frame in flight
+void Render::init_offscreen_targets() {
+    swapchain.format = vk::Format::eR8G8B8A8Unorm;
+    swapchain.extent = vk::Extent2D(width, height);
+    swapchain.transfer_src = true;
+
+    vk::ImageCreateInfo create_info(
+        vk::ImageCreateFlags(),
+        vk::ImageType::e2D,
+        swapchain.format,
+        vk::Extent3D(width, height, 1),
+        1,
+        1,
+        vk::SampleCountFlagBits::e1,
+        vk::ImageTiling::eOptimal,
+        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc
+    );
+    vk::ImageViewCreateInfo iv_create_info({}, {}, vk::ImageViewType::e2D, swapchain.format, {}, {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1});
+
+    for(uint32_t i = 0; i != frames_in_flight; ++i) {
+        vk::Image image = device.createImage(create_info);
+        swapchain.images.push_back(image);
+        swapchain.offscreen_memory.push_back(allocator.allocate_image(image, vk::MemoryPropertyFlagBits::eDeviceLocal, false));
+        iv_create_info.image = image;
+        swapchain.image_views.push_back(device.createImageView(iv_create_info));
+    }
+}
+
 void Render::init_depth_buffer() {
     auto physical_device = instance.enumeratePhysicalDevices().front(); // May be dangerous (deterministic?)
     vk::Format depth_format = vk::Format::eD16Unorm;
@@ -420,26 +1177,7 @@ void Render::init_depth_buffer() {
     );
 
     depth_buffer.image = device.createImage(create_info);
-    vk::PhysicalDeviceMemoryProperties mem_prop = physical_device.getMemoryProperties();
-    vk::MemoryRequirements mem_reqs = device.getImageMemoryRequirements(depth_buffer.image);
-    uint32_t type_bits = mem_reqs.memoryTypeBits;
-    uint32_t type_index = std::numeric_limits<uint32_t>::max();
-
-    for(uint32_t i = 0; i < mem_prop.memoryTypeCount; ++i) {
-        if((type_bits & 1) && (mem_prop.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal)) {
-            type_index = i;
-            break;
-        }
-        type_bits >>= 1;
-    }
-
-    if(type_index == std::numeric_limits<uint32_t>::max()) {
-        std::cerr << "Memory type not found\n";
-        std::exit(EXIT_FAILURE);
-    }
-
-    depth_buffer.memory = device.allocateMemory(vk::MemoryAllocateInfo(mem_reqs.size, type_index));
-    device.bindImageMemory(depth_buffer.image, depth_buffer.memory, 0);
+    depth_buffer.memory = allocator.allocate_image(depth_buffer.image, vk::MemoryPropertyFlagBits::eDeviceLocal, tiling == vk::ImageTiling::eLinear);
 
     depth_buffer.image_view = device.createImageView(vk::ImageViewCreateInfo(
         vk::ImageViewCreateFlags(), depth_buffer.image, vk::ImageViewType::e2D, depth_format, {}, {vk::ImageAspectFlagBits::eDepth, 0, 1, 0, 1}
@@ -447,200 +1185,922 @@ void Render::init_depth_buffer() {
 
 }
 
-// May need multiple of these later on to avoid data overwrite with multiple frames in flight
+// One slice per frame in flight so the CPU never writes data the GPU is still reading
 void Render::init_uniform_buffer() {
     auto physical_device = instance.enumeratePhysicalDevices().front(); // May be dangerous (deterministic?)
-    uniform_buffer.size = sizeof(glm::mat4x4) * 3;
-    uniform_buffer.buffer = device.createBuffer(vk::BufferCreateInfo(vk::BufferCreateFlags(), uniform_buffer.size, vk::BufferUsageFlagBits::eUniformBuffer));
-
-    vk::MemoryRequirements mem_reqs = device.getBufferMemoryRequirements(uniform_buffer.buffer);
-    vk::PhysicalDeviceMemoryProperties mem_props = physical_device.getMemoryProperties();
-    uint32_t type_bits = mem_reqs.memoryTypeBits;
-    uint32_t type_index = std::numeric_limits<uint32_t>::max();
-
-    for(uint32_t i = 0; i != mem_props.memoryTypeCount; ++i) {
-        if(
-            (type_bits & 1) &&
-            (mem_props.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) &&
-            (mem_props.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent)
-        ) {
-            type_index = i;
-            break;
+    uint32_t alignment = physical_device.getProperties().limits.minUniformBufferOffsetAlignment;
+    uniform_buffer.size = sizeof(CameraUniforms);
+    uniform_buffer.slice_size = (uniform_buffer.size + alignment - 1) / alignment * alignment;
+    uniform_buffer.buffer = device.createBuffer(vk::BufferCreateInfo(
+        vk::BufferCreateFlags(), uniform_buffer.slice_size * frames_in_flight, vk::BufferUsageFlagBits::eUniformBuffer
+    ));
+
+    uniform_buffer.memory = allocator.allocate_buffer(
+        uniform_buffer.buffer, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent
+    );
+}
+
+void Render::init_pipeline_cache() {
+    auto physical_device = instance.enumeratePhysicalDevices().front(); // May be dangerous (deterministic?)
+    vk::PhysicalDeviceProperties properties = physical_device.getProperties();
+    pipeline_cache_path = cache_directory() / pipeline_cache_file;
+
+    std::vector<char> data;
+    std::ifstream is(pipeline_cache_path, std::ios::binary | std::ios::ate);
+    if(is.is_open()) {
+        data.resize(is.tellg());
+        is.seekg(0, std::ios::beg);
+        is.read(data.data(), data.size());
+        if(!is) {
+            data.clear();
         }
+        is.close();
+    }
 
-        type_bits >>= 1;
+    if(!data.empty() && !valid_pipeline_cache(data, properties)) {
+        std::cerr << "Ignoring pipeline cache " << pipeline_cache_path << ", it is corrupt or from another device/driver\n";
+        data.clear();
     }
 
-    if(type_index == std::numeric_limits<uint32_t>::max()) {
-        std::cerr << "Memory type not found\n";
-        std::exit(EXIT_FAILURE);
+    try {
+        pipeline_cache = device.createPipelineCache(vk::PipelineCacheCreateInfo(vk::PipelineCacheCreateFlags(), data.size(), data.data()));
+    } catch(const vk::SystemError& e) {
+        std::cerr << "Could not load pipeline cache (" << e.what() << "), starting with an empty one\n";
+        data.clear();
+        pipeline_cache = device.createPipelineCache(vk::PipelineCacheCreateInfo());
+    }
+    std::cout << "Pipeline cache: loaded " << data.size() << " bytes from " << pipeline_cache_path << "\n";
+}
+
+// Written to a temporary file first so a crash never leaves a truncated cache behind
+void Render::save_pipeline_cache() {
+    std::vector<uint8_t> data = device.getPipelineCacheData(pipeline_cache);
+
+    std::error_code ec;
+    std::filesystem::create_directories(pipeline_cache_path.parent_path(), ec);
+    std::filesystem::path tmp_path = pipeline_cache_path;
+    tmp_path += ".tmp";
+
+    std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+    if(!os.is_open()) {
+        std::cerr << "Could not write pipeline cache to " << tmp_path << "\n";
+        return;
+    }
+    os.write(reinterpret_cast<const char*>(data.data()), data.size());
+    os.close();
+    if(!os) {
+        std::cerr << "Could not write pipeline cache to " << tmp_path << "\n";
+        std::filesystem::remove(tmp_path, ec);
+        return;
     }
 
-    uniform_buffer.memory = device.allocateMemory(vk::MemoryAllocateInfo(mem_reqs.size, type_index));
-    device.bindBufferMemory(uniform_buffer.buffer, uniform_buffer.memory, 0);
+    std::filesystem::rename(tmp_path, pipeline_cache_path, ec);
+    if(ec) {
+        std::cerr << "Could not write pipeline cache to " << pipeline_cache_path << ": " << ec.message() << "\n";
+    }
 }
 
 void Render::init_pipeline() {
     std::vector<vk::DescriptorSetLayoutBinding> bindings;
-    bindings.push_back(vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eVertex));
+    // Dynamic so each frame in flight can bind its own slice of the uniform buffer
+    bindings.push_back(vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eUniformBufferDynamic, 1, vk::ShaderStageFlagBits::eVertex));
+    // ObjectData, written once the object buffer exists
+    bindings.push_back(vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eVertex));
+    // Model matrices, a slice per frame in flight like the uniform buffer
+    bindings.push_back(vk::DescriptorSetLayoutBinding(2, vk::DescriptorType::eStorageBufferDynamic, 1, vk::ShaderStageFlagBits::eVertex));
     vk::DescriptorSetLayoutCreateInfo create_info(vk::DescriptorSetLayoutCreateFlags(), bindings);
     descriptor_set_layout = device.createDescriptorSetLayout(create_info);
 
-    vk::DescriptorPoolSize pool_size(vk::DescriptorType::eUniformBuffer, 1);
-    descriptor_pool = device.createDescriptorPool(vk::DescriptorPoolCreateInfo(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet, 1, pool_size));
+    std::array<vk::DescriptorPoolSize, 3> pool_sizes = {
+        vk::DescriptorPoolSize(vk::DescriptorType::eUniformBufferDynamic, 1),
+        vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, 1),
+        vk::DescriptorPoolSize(vk::DescriptorType::eStorageBufferDynamic, 1)
+    };
+    descriptor_pool = device.createDescriptorPool(vk::DescriptorPoolCreateInfo(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet, 1, pool_sizes));
 
     vk::DescriptorSetAllocateInfo allocate_info(descriptor_pool, descriptor_set_layout);
     descriptor_set = device.allocateDescriptorSets(allocate_info).front();
 
     vk::DescriptorBufferInfo descriptor_buffer_info(uniform_buffer.buffer, 0, uniform_buffer.size);
-    vk::WriteDescriptorSet write_descriptor_set(descriptor_set, 0, 0, vk::DescriptorType::eUniformBuffer, {}, descriptor_buffer_info);
+    vk::WriteDescriptorSet write_descriptor_set(descriptor_set, 0, 0, vk::DescriptorType::eUniformBufferDynamic, {}, descriptor_buffer_info);
     device.updateDescriptorSets(write_descriptor_set, nullptr);
 
     pipeline_layout = device.createPipelineLayout(vk::PipelineLayoutCreateInfo(vk::PipelineLayoutCreateFlags(), descriptor_set_layout));
 
-    vk::ShaderModule vertex_shader_module = load_SPIRV_shader(vertex_shader_file, device);
-    vk::ShaderModule fragment_shader_module = load_SPIRV_shader(fragment_shader_file, device);
-
-    std::array<vk::PipelineShaderStageCreateInfo, 2> pipeline_shader_stage_create_infos = {
-        vk::PipelineShaderStageCreateInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eVertex, vertex_shader_module, "main"),
-        vk::PipelineShaderStageCreateInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eFragment, fragment_shader_module, "main"),
+    PipelineRegistry::Config config {};
+    config.device = device;
+    config.cache = pipeline_cache;
+    config.layout = pipeline_layout;
+    config.vertex_shader = load_SPIRV_shader(vertex_shader_file, device);
+    config.fragment_shader = load_SPIRV_shader(fragment_shader_file, device);
+    config.color_format = swapchain.format;
+    config.depth_format = vk::Format::eD16Unorm;
+    // Frames recorded while the variant compiled used a stand-in, redraw them even if the loop is idle
+    config.on_ready = [this] {
+        request_frame();
     };
 
-    vk::VertexInputBindingDescription vertex_input_binding_description(0, sizeof(Vertex));
-    std::array<vk::VertexInputAttributeDescription, 2> vertex_input_attribute_descriptions = {
-        vk::VertexInputAttributeDescription(0, 0, vk::Format::eR32G32B32A32Sfloat, 0),
-        vk::VertexInputAttributeDescription(1, 0, vk::Format::eR32G32B32A32Sfloat, 16)
+    // Only the default variant is built here, every other one compiles in the background on first use
+    vk::PipelineCreationFeedback pipeline_feedback {};
+    auto start = std::chrono::steady_clock::now();
+    pipelines.init(config, &pipeline_feedback);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Feedback is optional, an implementation may leave it invalid
+    std::cout << "Graphics pipeline created in " << elapsed.count() << " ms, pipeline cache ";
+    if(pipeline_feedback.flags & vk::PipelineCreationFeedbackFlagBits::eValid) {
+        bool hit = static_cast<bool>(pipeline_feedback.flags & vk::PipelineCreationFeedbackFlagBits::eApplicationPipelineCacheHit);
+        std::cout << (hit ? "hit\n" : "miss\n");
+    } else {
+        std::cout << "hit unknown\n";
+    }
+}
+
+void Render::init_growable_buffer(GrowableBuffer& b, vk::BufferUsageFlags usage, vk::DeviceSize size) {
+    b.size = size;
+    b.usage = usage | vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst;
+    b.buffer = device.createBuffer(vk::BufferCreateInfo(vk::BufferCreateFlags(), size, b.usage));
+
+    // Vertex fetch should never go over PCIe, only map the memory when it is shared with the host anyway
+    vk::MemoryPropertyFlags flags = vk::MemoryPropertyFlagBits::eDeviceLocal;
+    if(unified_memory) {
+        flags |= vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+    }
+    b.memory = allocator.allocate_buffer(b.buffer, flags);
+    b.ranges.grow(size);
+}
+
+// Reallocates the buffer with at least min_free_size contiguous free bytes at its end.
+// Offsets handed out so far stay valid since the old contents are copied over as is.
+void Render::grow_buffer(GrowableBuffer& b, vk::DeviceSize min_free_size) {
+    // Queued uploads still target the old buffer
+    if(!staging.pending.empty()) {
+        flush_uploads();
+    }
+
+    vk::Buffer old_buffer = b.buffer;
+    Allocation old_memory = b.memory;
+    vk::DeviceSize old_size = b.size;
+
+    init_growable_buffer(b, b.usage, std::max(old_size * 2, old_size + min_free_size));
+
+    if(unified_memory) {
+        memcpy(b.memory.mapped, old_memory.mapped, old_size);
+        // Frames in flight may still be reading from the old buffer
+        device.waitIdle();
+    } else {
+        // Waits for everything submitted before, including frames still reading from the old buffer
+        submit_immediate([&](vk::CommandBuffer command_buffer) {
+            command_buffer.copyBuffer(old_buffer, b.buffer, vk::BufferCopy(0, 0, old_size));
+        });
+    }
+
+    device.destroyBuffer(old_buffer);
+    allocator.free(old_memory);
+
+    // Safe to rewrite now, the waits above leave no frame that could have the set bound
+    if(&b == &object_buffer) {
+        write_object_descriptor();
+    }
+    invalidate_command_buffers();
+}
+
+void Render::destroy_growable_buffer(GrowableBuffer& b) {
+    device.destroyBuffer(b.buffer);
+    allocator.free(b.memory);
+}
+
+void Render::init_staging_buffer() {
+    staging.size = staging_buffer_size;
+    staging.buffer = device.createBuffer(vk::BufferCreateInfo(vk::BufferCreateFlags(), staging.size, vk::BufferUsageFlagBits::eTransferSrc));
+
+    // Stays mapped for the lifetime of the renderer
+    staging.memory = allocator.allocate_buffer(
+        staging.buffer, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent
+    );
+}
+
+// Vertex ranges are aligned to their format's stride and index ranges to sizeof(uint32_t),
+// so offsets can be expressed as a first vertex or first index
+uint64_t Render::allocate_range(GrowableBuffer& b, vk::DeviceSize size, vk::DeviceSize alignment) {
+    uint64_t offset = b.ranges.allocate(size, alignment);
+    if(offset == RangeAllocator::invalid_offset) {
+        // Room for the padding up to the next aligned offset as well, strides are not powers of two
+        grow_buffer(b, size + alignment - 1);
+        offset = b.ranges.allocate(size, alignment);
+        if(offset == RangeAllocator::invalid_offset) {
+            std::cerr << "Could not allocate " << size << " bytes after growing the buffer to " << b.size << " bytes\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    return offset;
+}
+
+// Without drawIndirectFirstInstance the vertex shader can not find an object's ObjectData
+PipelineKey Render::supported_style(PipelineKey style) {
+    if(draw_indirect_first_instance || !style.format.uses_object_data()) {
+        return style;
+    }
+
+    if(!warned_object_data) {
+        std::cerr << "drawIndirectFirstInstance is not supported, quantized positions and per object colors are stored unpacked\n";
+        warned_object_data = true;
+    }
+    if(style.format.position == PositionFormat::eQuantized16) {
+        style.format.position = PositionFormat::eFloat3;
+    }
+    if(style.format.color == ColorFormat::eObject) {
+        style.format.color = ColorFormat::eUnorm8;
+    }
+    return style;
+}
+
+uint64_t Render::allocate_vertices(VertexFormat format, size_t count) {
+    return allocate_range(vertex_buffer, vk::DeviceSize(format.stride()) * count, format.stride());
+}
+
+void Render::upload_vertices(VertexFormat format, uint64_t offset, const Vertex* vertices, size_t count, glm::vec3 min, glm::vec3 max) {
+    if(format == VertexFormat {}) {
+        upload_to(vertex_buffer, offset, vertices, sizeof(Vertex) * count);
+        return;
+    }
+
+    std::vector<char> packed(size_t(format.stride()) * count);
+    pack_vertices(format, vertices, count, min, max - min, packed.data());
+    upload_to(vertex_buffer, offset, packed.data(), packed.size());
+}
+
+// Hands fill chunks that fit the staging ring, on unified memory the vertex buffer itself.
+// Returns the color of the first vertex, for objects with ColorFormat::eObject
+glm::vec4 Render::stream_vertices(
+    VertexFormat format, uint64_t offset, size_t count, glm::vec3 min, glm::vec3 max, const VertexFill& fill
+) {
+    uint32_t stride = format.stride();
+    bool packed = format != VertexFormat {};
+    glm::vec4 first_color(1.0f);
+    size_t chunk_vertices = staging.size / stride;
+    JobSystem& jobs = job_system();
+    // Each chunk is filled in parallel ranges, all of which have to be written before its copy is queued.
+    // Generators write Vertex, for packed formats each range goes through a scratch buffer.
+    auto fill_parallel = [&](char* out, size_t first, size_t n) {
+        jobs.wait(jobs.parallel_for(0, n, stream_vertices_per_job, [&](size_t begin, size_t end) {
+            std::vector<Vertex> scratch;
+            Vertex* vertices = reinterpret_cast<Vertex*>(out) + begin;
+            if(packed) {
+                scratch.resize(end - begin);
+                vertices = scratch.data();
+            }
+            fill(vertices, first + begin, end - begin);
+            if(first + begin == 0) {
+                first_color = vertices[0].color;
+            }
+            if(packed) {
+                pack_vertices(format, vertices, end - begin, min, max - min, out + begin * stride);
+            }
+        }));
     };
+    for(size_t first = 0; first < count; first += chunk_vertices) {
+        size_t n = std::min(chunk_vertices, count - first);
+        vk::DeviceSize dst_offset = offset + first * stride;
+        if(unified_memory) {
+            fill_parallel(vertex_buffer.memory.mapped + dst_offset, first, n);
+            continue;
+        }
+
+        vk::DeviceSize staging_offset = allocate_staging(n * stride);
+        fill_parallel(staging.memory.mapped + staging_offset, first, n);
+        staging.pending.push_back({vertex_buffer.buffer, vk::BufferCopy(staging_offset, dst_offset, n * stride)});
+    }
+    return first_color;
+}
+
+uint32_t Render::add_object_data(glm::vec4 color, glm::vec3 min, glm::vec3 max) {
+    ObjectData data {color, glm::vec4(min, 0.0f), glm::vec4(max - min, 0.0f)};
+    uint64_t offset = allocate_range(object_buffer, sizeof(ObjectData), sizeof(ObjectData));
+    upload_to(object_buffer, offset, &data, sizeof(ObjectData));
+    uint32_t slot = offset / sizeof(ObjectData);
+    set_slot_transform(slot, glm::mat4(1.0f));
+    return slot;
+}
+
+void Render::set_slot_transform(uint32_t slot, const glm::mat4& model) {
+    if(slot >= transforms.size()) {
+        transforms.resize(slot + 1, glm::mat4(1.0f));
+    }
+    transforms[slot] = model;
+    frame_requested = true;
+}
 
-    vk::PipelineVertexInputStateCreateInfo pipeline_vertex_input_state_create_info(vk::PipelineVertexInputStateCreateFlags(), vertex_input_binding_description, vertex_input_attribute_descriptions);
-    vk::PipelineInputAssemblyStateCreateInfo pipeline_input_assembly_state_create_info(vk::PipelineInputAssemblyStateCreateFlags(), vk::PrimitiveTopology::eLineStrip);
-
-    vk::PipelineViewportStateCreateInfo pipeline_viewport_state_create_info(vk::PipelineViewportStateCreateFlags(), 1, nullptr, 1, nullptr);
-
-    vk::PipelineRasterizationStateCreateInfo pipeline_rasterization_state_create_info(
-        vk::PipelineRasterizationStateCreateFlags(),
-        false,
-        false,
-        vk::PolygonMode::eFill,
-        vk::CullModeFlagBits::eBack,
-        vk::FrontFace::eClockwise,
-        false,
-        0.0f,
-        0.0f,
-        0.0f,
-        1.0f
+// The frame's slices are rewritten in full right before recording, slices of frames still in flight stay untouched
+void Render::write_frame_data() {
+    CameraUniforms camera {view, projection, view_projection};
+    memcpy(uniform_buffer.memory.mapped + current_frame * uniform_buffer.slice_size, &camera, sizeof(camera));
+
+    if(transforms.size() > transform_ring.capacity) {
+        // Frames in flight may still be reading the old ring
+        device.waitIdle();
+        uint32_t capacity = std::max<uint32_t>(transform_ring.capacity * 2, transforms.size());
+        destroy_transform_ring();
+        init_transform_ring(capacity);
+        write_transform_descriptors();
+    }
+    memcpy(
+        transform_ring.memory.mapped + current_frame * transform_ring.slice_size, transforms.data(), transforms.size() * sizeof(glm::mat4)
     );
+}
 
-    vk::PipelineMultisampleStateCreateInfo pipeline_multisample_state_create_info(vk::PipelineMultisampleStateCreateFlags(), vk::SampleCountFlagBits::e1);
+void Render::init_transform_ring(uint32_t capacity) {
+    auto physical_device = instance.enumeratePhysicalDevices().front(); // May be dangerous (deterministic?)
+    vk::DeviceSize alignment = physical_device.getProperties().limits.minStorageBufferOffsetAlignment;
+    transform_ring.capacity = capacity;
+    transform_ring.slice_size = (capacity * sizeof(glm::mat4) + alignment - 1) / alignment * alignment;
+    transform_ring.buffer = device.createBuffer(vk::BufferCreateInfo(
+        vk::BufferCreateFlags(), transform_ring.slice_size * frames_in_flight, vk::BufferUsageFlagBits::eStorageBuffer
+    ));
 
-    vk::StencilOpState stencil_op_state(vk::StencilOp::eKeep, vk::StencilOp::eKeep, vk::StencilOp::eKeep, vk::CompareOp::eAlways);
-    vk::PipelineDepthStencilStateCreateInfo pipeline_depth_stencil_state_create_info(
-        vk::PipelineDepthStencilStateCreateFlags(),
-        true,
-        true,
-        vk::CompareOp::eLessOrEqual,
-        false,
-        false,
-        stencil_op_state,
-        stencil_op_state
+    // Every vertex reads its object's matrix, so prefer device local memory the host can still write
+    vk::MemoryPropertyFlags flags = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+    if(allocator.has_memory_type(flags | vk::MemoryPropertyFlagBits::eDeviceLocal)) {
+        flags |= vk::MemoryPropertyFlagBits::eDeviceLocal;
+    }
+    transform_ring.memory = allocator.allocate_buffer(transform_ring.buffer, flags);
+}
+
+void Render::destroy_transform_ring() {
+    device.destroyBuffer(transform_ring.buffer);
+    allocator.free(transform_ring.memory);
+}
+
+// The graphics set takes one slice with a dynamic offset, each frame's culling set its own slice
+void Render::write_transform_descriptors() {
+    invalidate_command_buffers();
+    vk::DescriptorBufferInfo graphics_info(transform_ring.buffer, 0, transform_ring.slice_size);
+    device.updateDescriptorSets(
+        vk::WriteDescriptorSet(descriptor_set, 2, 0, vk::DescriptorType::eStorageBufferDynamic, {}, graphics_info), nullptr
     );
 
-    vk::ColorComponentFlags color_component_flags(vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA);
-    vk::PipelineColorBlendAttachmentState pipeline_color_blend_attachment_state(
-        false,
-        vk::BlendFactor::eZero,
-        vk::BlendFactor::eZero,
-        vk::BlendOp::eAdd,
-        vk::BlendFactor::eZero,
-        vk::BlendFactor::eZero,
-        vk::BlendOp::eAdd,
-        color_component_flags
+    if(!gpu_culling) {
+        return;
+    }
+    for(uint32_t i = 0; i != frames_in_flight; ++i) {
+        vk::DescriptorBufferInfo cull_info(transform_ring.buffer, i * transform_ring.slice_size, transform_ring.slice_size);
+        device.updateDescriptorSets(
+            vk::WriteDescriptorSet(frames[i].cull_descriptor_set, 4, 0, vk::DescriptorType::eStorageBuffer, {}, cull_info), nullptr
+        );
+    }
+}
+
+void Render::write_object_descriptor() {
+    invalidate_command_buffers();
+    vk::DescriptorBufferInfo buffer_info(object_buffer.buffer, 0, VK_WHOLE_SIZE);
+    device.updateDescriptorSets(
+        vk::WriteDescriptorSet(descriptor_set, 1, 0, vk::DescriptorType::eStorageBuffer, {}, buffer_info), nullptr
     );
+}
+
+// Writes in place on unified memory, otherwise queues a copy that the next frame records
+void Render::upload_to(GrowableBuffer& b, vk::DeviceSize offset, const void* data, vk::DeviceSize size) {
+    if(unified_memory) {
+        memcpy(b.memory.mapped + offset, data, size);
+        return;
+    }
+
+    upload_buffer(b.buffer, offset, data, size);
+}
+
+// Stages the data and queues a copy into dst that the next frame records before drawing
+void Render::upload_buffer(vk::Buffer dst, vk::DeviceSize offset, const void* data, vk::DeviceSize size) {
+    const char* src = static_cast<const char*>(data);
+    while(size > 0) {
+        vk::DeviceSize chunk = std::min(size, staging.size);
+        vk::DeviceSize staging_offset = allocate_staging(chunk);
+        memcpy(staging.memory.mapped + staging_offset, src, chunk);
+        staging.pending.push_back({dst, vk::BufferCopy(staging_offset, offset, chunk)});
+
+        src += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+// Returns an offset into the staging buffer, ranges never wrap around its end
+vk::DeviceSize Render::allocate_staging(vk::DeviceSize size) {
+    vk::DeviceSize start = (staging.head + 15) / 16 * 16;
+    if(start % staging.size + size > staging.size) {
+        start += staging.size - start % staging.size;
+    }
 
-    vk::PipelineColorBlendStateCreateInfo pipeline_color_blend_state_create_info(
-        vk::PipelineColorBlendStateCreateFlags(),
-        false,
-        vk::LogicOp::eNoOp,
-        pipeline_color_blend_attachment_state,
-        {{1.0f, 1.0f, 1.0f, 1.0f}}
+    if(start + size - staging.tail > staging.size) {
+        // Ring is full, push out what is pending and wait for the GPU to consume it
+        flush_uploads();
+        start = 0;
+    }
+
+    staging.head = start + size;
+    return start % staging.size;
+}
+
+void Render::record_uploads(vk::CommandBuffer command_buffer) {
+    if(staging.pending.empty()) {
+        return;
+    }
+
+    vk::PipelineStageFlags read_stages =
+        vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eComputeShader;
+
+    // Previous frames may still be reading from the ranges being overwritten
+    command_buffer.pipelineBarrier(read_stages, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, nullptr);
+
+    // One copyBuffer per destination buffer, there are only ever a handful of them.
+    // Regions of one copy must not overlap, a range written twice (updated, or freed and reused) starts another
+    // copy after a barrier, so the later write lands last.
+    std::vector<vk::BufferCopy> regions;
+    std::map<vk::DeviceSize, vk::DeviceSize> written; // Destination offset -> end, of the regions in this copy
+    vk::MemoryBarrier write_after_write(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eTransferWrite);
+    while(!staging.pending.empty()) {
+        vk::Buffer dst = staging.pending.front().dst;
+        auto others = std::stable_partition(staging.pending.begin(), staging.pending.end(), [&](const StagingCopy& copy) {
+            return copy.dst != dst;
+        });
+        regions.clear();
+        written.clear();
+        for(auto it = others; it != staging.pending.end(); ++it) {
+            vk::DeviceSize begin = it->region.dstOffset;
+            vk::DeviceSize end = begin + it->region.size;
+            auto next = written.lower_bound(end);
+            bool overlaps = next != written.begin() && std::prev(next)->second > begin;
+            if(overlaps) {
+                command_buffer.copyBuffer(staging.buffer, dst, regions);
+                command_buffer.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {}, write_after_write, nullptr, nullptr
+                );
+                regions.clear();
+                written.clear();
+            }
+            // Ranges packed one after the other are contiguous in staging too, one region covers both
+            if(!regions.empty() && regions.back().srcOffset + regions.back().size == it->region.srcOffset &&
+                regions.back().dstOffset + regions.back().size == begin) {
+                regions.back().size += it->region.size;
+                written[regions.back().dstOffset] = end;
+                continue;
+            }
+            regions.push_back(it->region);
+            written[begin] = end;
+        }
+        command_buffer.copyBuffer(staging.buffer, dst, regions);
+        staging.pending.erase(others, staging.pending.end());
+    }
+
+    vk::MemoryBarrier barrier(
+        vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead
     );
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, read_stages, {}, barrier, nullptr, nullptr);
+}
+
+void Render::flush_uploads() {
+    submit_immediate([this](vk::CommandBuffer command_buffer) {
+        record_uploads(command_buffer);
+    });
+
+    // Nothing in the ring is in use anymore
+    staging.head = 0;
+    staging.tail = 0;
+    for(auto& frame : frames) {
+        frame.staging_head = 0;
+    }
+}
+
+// Records and submits a one off command buffer, returns once the GPU has executed it
+// along with everything submitted before it
+void Render::submit_immediate(const std::function<void(vk::CommandBuffer)>& record) {
+    vk::CommandBuffer command_buffer = device.allocateCommandBuffers(
+        vk::CommandBufferAllocateInfo(command_pool, vk::CommandBufferLevel::ePrimary, 1)
+    ).front();
+    command_buffer.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    // Make earlier submissions' writes visible to whatever is recorded here
+    vk::MemoryBarrier barrier(vk::AccessFlagBits::eMemoryWrite, vk::AccessFlagBits::eMemoryRead | vk::AccessFlagBits::eMemoryWrite);
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eAllCommands, {}, barrier, nullptr, nullptr);
+
+    record(command_buffer);
+    command_buffer.end();
+
+    vk::Fence fence = device.createFence(vk::FenceCreateInfo());
+    graphics_queue.submit(vk::SubmitInfo({}, {}, command_buffer), fence);
+    while(vk::Result::eTimeout == device.waitForFences(fence, VK_TRUE, 100000000))
+        ;
+
+    device.destroyFence(fence);
+    device.freeCommandBuffers(command_pool, command_buffer);
+}
+
+void Render::init_cull_pipeline() {
+    if(!gpu_culling) {
+        return;
+    }
 
-    std::array<vk::DynamicState, 2> dynamic_states = {vk::DynamicState::eViewport, vk::DynamicState::eScissor};
-    vk::PipelineDynamicStateCreateInfo pipeline_dynamic_state_create_info(vk::PipelineDynamicStateCreateFlags(), dynamic_states);
+    // Draws, cull objects, visible draws, visible counts and transforms
+    std::array<vk::DescriptorSetLayoutBinding, 5> bindings = {
+        vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(3, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(4, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute)
+    };
+    cull.descriptor_set_layout = device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo(vk::DescriptorSetLayoutCreateFlags(), bindings));
+
+    // One set per frame in flight since each frame writes its own visible draw list
+    vk::DescriptorPoolSize pool_size(vk::DescriptorType::eStorageBuffer, bindings.size() * frames_in_flight);
+    cull.descriptor_pool = device.createDescriptorPool(vk::DescriptorPoolCreateInfo(vk::DescriptorPoolCreateFlags(), frames_in_flight, pool_size));
+
+    std::vector<vk::DescriptorSetLayout> layouts(frames_in_flight, cull.descriptor_set_layout);
+    std::vector<vk::DescriptorSet> sets = device.allocateDescriptorSets(vk::DescriptorSetAllocateInfo(cull.descriptor_pool, layouts));
+    for(uint32_t i = 0; i != frames_in_flight; ++i) {
+        frames[i].cull_descriptor_set = sets[i];
+    }
 
-    vk::PipelineRenderingCreateInfo pipeline_rendering_create_info {};
-    pipeline_rendering_create_info.colorAttachmentCount = 1;
-    pipeline_rendering_create_info.pColorAttachmentFormats = &swapchain.format;
-    pipeline_rendering_create_info.depthAttachmentFormat = vk::Format::eD16Unorm;
+    // Six frustum planes followed by the object count
+    vk::PushConstantRange push_constant_range(vk::ShaderStageFlagBits::eCompute, 0, sizeof(glm::vec4) * 6 + sizeof(uint32_t));
+    cull.pipeline_layout = device.createPipelineLayout(
+        vk::PipelineLayoutCreateInfo(vk::PipelineLayoutCreateFlags(), cull.descriptor_set_layout, push_constant_range)
+    );
 
-    vk::GraphicsPipelineCreateInfo graphics_pipeline_create_info(
+    vk::ShaderModule cull_shader_module = load_SPIRV_shader(cull_shader_file, device);
+    vk::ComputePipelineCreateInfo create_info(
         vk::PipelineCreateFlags(),
-        pipeline_shader_stage_create_infos,
-        &pipeline_vertex_input_state_create_info,
-        &pipeline_input_assembly_state_create_info,
-        nullptr,
-        &pipeline_viewport_state_create_info,
-        &pipeline_rasterization_state_create_info,
-        &pipeline_multisample_state_create_info,
-        &pipeline_depth_stencil_state_create_info,
-        &pipeline_color_blend_state_create_info,
-        &pipeline_dynamic_state_create_info,
-        pipeline_layout
+        vk::PipelineShaderStageCreateInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eCompute, cull_shader_module, "main"),
+        cull.pipeline_layout
     );
-    graphics_pipeline_create_info.pNext = &pipeline_rendering_create_info;
-    
+
     vk::Result result;
-    std::tie(result, pipeline) = device.createGraphicsPipeline(nullptr, graphics_pipeline_create_info);
-    switch(result) {
-        case vk::Result::eSuccess:
-            break;
-        case vk::Result::ePipelineCompileRequired:
-            break;
-        default:
-            std::cerr << "Something went wrong with graphics pipeline creation\n";
-            std::exit(EXIT_FAILURE);
+    std::tie(result, cull.pipeline) = device.createComputePipeline(pipeline_cache, create_info);
+    if(result != vk::Result::eSuccess) {
+        std::cerr << "Something went wrong with culling pipeline creation\n";
+        std::exit(EXIT_FAILURE);
     }
 
-    device.destroyShaderModule(vertex_shader_module);
-    device.destroyShaderModule(fragment_shader_module);
+    device.destroyShaderModule(cull_shader_module);
 }
 
-void Render::init_vertex_buffer() {
-    auto physical_device = instance.enumeratePhysicalDevices().front(); // May be dangerous (deterministic?)
-    vk::DeviceSize buffer_size = vertex_buffer.size;
-    vk::BufferCreateInfo buffer_info(vk::BufferCreateFlags(), buffer_size, vk::BufferUsageFlagBits::eVertexBuffer);
-    vertex_buffer.buffer = device.createBuffer(buffer_info);
+void Render::init_indirect_buffer(uint32_t capacity) {
+    indirect_buffer.capacity = capacity;
+    indirect_buffer.buffer = device.createBuffer(vk::BufferCreateInfo(
+        vk::BufferCreateFlags(),
+        capacity * sizeof(vk::DrawIndexedIndirectCommand),
+        vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst
+    ));
+    indirect_buffer.memory = allocator.allocate_buffer(indirect_buffer.buffer, vk::MemoryPropertyFlagBits::eDeviceLocal);
 
-    vk::MemoryRequirements mem_reqs = device.getBufferMemoryRequirements(vertex_buffer.buffer);
-    
-    vk::PhysicalDeviceMemoryProperties mem_props = physical_device.getMemoryProperties();
-    uint32_t type_bits = mem_reqs.memoryTypeBits;
-    uint32_t type_index = std::numeric_limits<uint32_t>::max();
-
-    for(uint32_t i = 0; i != mem_props.memoryTypeCount; ++i) {
-        // Running on unified memory architecture so these flags are fine even in the case of vertex buffers
-        if(
-            (type_bits & 1) &&
-            (mem_props.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) &&
-            (mem_props.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent)
-        ) {
-            type_index = i;
-            break;
+    if(!gpu_culling) {
+        return;
+    }
+
+    indirect_buffer.cull_objects_buffer = device.createBuffer(vk::BufferCreateInfo(
+        vk::BufferCreateFlags(), capacity * sizeof(CullObject), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst
+    ));
+    indirect_buffer.cull_objects_memory = allocator.allocate_buffer(indirect_buffer.cull_objects_buffer, vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+    vk::BufferUsageFlags cull_usage =
+        vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst;
+    for(auto& frame : frames) {
+        frame.cull_buffer = device.createBuffer(vk::BufferCreateInfo(vk::BufferCreateFlags(), capacity * sizeof(vk::DrawIndexedIndirectCommand), cull_usage));
+        frame.cull_memory = allocator.allocate_buffer(frame.cull_buffer, vk::MemoryPropertyFlagBits::eDeviceLocal);
+        // There are never more draw groups than draw commands
+        frame.cull_count_buffer = device.createBuffer(vk::BufferCreateInfo(vk::BufferCreateFlags(), capacity * sizeof(uint32_t), cull_usage));
+        frame.cull_count_memory = allocator.allocate_buffer(frame.cull_count_buffer, vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+        std::array<vk::DescriptorBufferInfo, 4> buffer_infos = {
+            vk::DescriptorBufferInfo(indirect_buffer.buffer, 0, VK_WHOLE_SIZE),
+            vk::DescriptorBufferInfo(indirect_buffer.cull_objects_buffer, 0, VK_WHOLE_SIZE),
+            vk::DescriptorBufferInfo(frame.cull_buffer, 0, VK_WHOLE_SIZE),
+            vk::DescriptorBufferInfo(frame.cull_count_buffer, 0, VK_WHOLE_SIZE)
+        };
+        std::array<vk::WriteDescriptorSet, 4> writes;
+        for(uint32_t i = 0; i != writes.size(); ++i) {
+            writes[i] = vk::WriteDescriptorSet(frame.cull_descriptor_set, i, 0, vk::DescriptorType::eStorageBuffer, {}, buffer_infos[i]);
         }
+        device.updateDescriptorSets(writes, nullptr);
+    }
+}
 
-        type_bits >>= 1;
+void Render::destroy_indirect_buffer() {
+    device.destroyBuffer(indirect_buffer.buffer);
+    allocator.free(indirect_buffer.memory);
+    if(gpu_culling) {
+        device.destroyBuffer(indirect_buffer.cull_objects_buffer);
+        allocator.free(indirect_buffer.cull_objects_memory);
+        for(auto& frame : frames) {
+            device.destroyBuffer(frame.cull_buffer);
+            allocator.free(frame.cull_memory);
+            device.destroyBuffer(frame.cull_count_buffer);
+            allocator.free(frame.cull_count_memory);
+        }
     }
+}
 
-    if(type_index == std::numeric_limits<uint32_t>::max()) {
-        std::cerr << "Memory type not found\n";
-        std::exit(EXIT_FAILURE);
+// Rebuilds the draw commands and queues their upload, only when render objects changed
+void Render::update_draw_commands() {
+    if(!draw_commands_dirty) {
+        return;
+    }
+    draw_commands_dirty = false;
+    invalidate_command_buffers();
+
+    // Opaque groups first so translucent ones blend over them, otherwise in order of first use.
+    // There are only ever a handful of groups, a linear search is enough.
+    std::vector<DrawGroup> groups;
+    std::vector<std::vector<uint32_t>> group_objects;
+    for(uint32_t i = 0; i != render_objects.size(); ++i) {
+        const RenderObject& ro = render_objects[i];
+        if(!ro.alive) {
+            continue;
+        }
+        bool indexed = ro.index_count != 0;
+        auto it = std::find_if(groups.begin(), groups.end(), [&](const DrawGroup& group) {
+            return group.key == ro.style && group.indexed == indexed;
+        });
+        if(it == groups.end()) {
+            groups.push_back({ro.style, indexed, 0, 0});
+            group_objects.emplace_back();
+            it = groups.end() - 1;
+        }
+        group_objects[it - groups.begin()].push_back(i);
+    }
+    std::vector<uint32_t> order(groups.size());
+    for(uint32_t g = 0; g != order.size(); ++g) {
+        order[g] = g;
+    }
+    std::stable_partition(order.begin(), order.end(), [&groups](uint32_t g) {
+        return groups[g].key.blend == BlendMode::eOpaque;
+    });
+
+    // A group's draws go out in batches of at most maxDrawIndirectCount, with culling each batch gets its own
+    // visible count and compacts its draws from its own first command on
+    draw_commands.clear();
+    draw_groups.clear();
+    draw_items.clear();
+    std::vector<CullObject> cull_objects;
+    for(uint32_t g : order) {
+        DrawGroup group = groups[g];
+        group.first = draw_commands.size();
+        uint32_t first_item = draw_items.size();
+        for(uint32_t i : group_objects[g]) {
+            const RenderObject& ro = render_objects[i];
+            uint32_t first_instance = draw_indirect_first_instance ? ro.object_slot : 0;
+            if(group.indexed) {
+                draw_commands.push_back(vk::DrawIndexedIndirectCommand(ro.index_count, 1, ro.first_index, ro.first_vertex, first_instance));
+            } else {
+                // Read as DrawIndirectCommand(vertex_count, 1, first_vertex, first_instance), the last field is unused
+                draw_commands.push_back(vk::DrawIndexedIndirectCommand(ro.vertex_count, 1, ro.first_vertex, first_instance, 0));
+            }
+            uint32_t batch = group.count / max_draw_indirect_count;
+            uint32_t batch_first = group.first + batch * max_draw_indirect_count;
+            cull_objects.push_back({ro.bounds, first_item + batch, batch_first, ro.object_slot, 0});
+            ++group.count;
+        }
+        for(uint32_t first = 0; first < group.count; first += max_draw_indirect_count) {
+            uint32_t count = std::min(max_draw_indirect_count, group.count - first);
+            draw_items.push_back({static_cast<uint32_t>(draw_groups.size()), first, count});
+        }
+        draw_groups.push_back(group);
     }
 
-    vertex_buffer.memory = device.allocateMemory(vk::MemoryAllocateInfo(mem_reqs.size, type_index));
-    device.bindBufferMemory(vertex_buffer.buffer, vertex_buffer.memory, 0);
+    if(draw_commands.size() > indirect_buffer.capacity) {
+        // Frames in flight may still be reading draw commands from the old buffers
+        device.waitIdle();
+        destroy_indirect_buffer();
+        init_indirect_buffer(std::max<uint32_t>(indirect_buffer.capacity * 2, draw_commands.size()));
+    }
+
+    if(!draw_commands.empty()) {
+        upload_buffer(indirect_buffer.buffer, 0, draw_commands.data(), draw_commands.size() * sizeof(vk::DrawIndexedIndirectCommand));
+        if(gpu_culling) {
+            upload_buffer(indirect_buffer.cull_objects_buffer, 0, cull_objects.data(), cull_objects.size() * sizeof(CullObject));
+        }
+    }
+}
+
+// Compacts the draw commands of objects inside the view frustum, per draw batch, into the frame's cull buffer
+void Render::record_culling(vk::CommandBuffer command_buffer) {
+    if(!gpu_culling || draw_commands.empty()) {
+        return;
+    }
+
+    Frame& frame = frames[current_frame];
+    command_buffer.fillBuffer(frame.cull_count_buffer, 0, draw_items.size() * sizeof(uint32_t), 0);
+    vk::MemoryBarrier clear_barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, {}, clear_barrier, nullptr, nullptr);
+
+    struct {
+        std::array<glm::vec4, 6> planes;
+        uint32_t object_count;
+    } push_constants;
+    push_constants.planes = frustum_planes(view_projection);
+    push_constants.object_count = draw_commands.size();
+
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute, cull.pipeline);
+    command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, cull.pipeline_layout, 0, frame.cull_descriptor_set, nullptr);
+    command_buffer.pushConstants(
+        cull.pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(glm::vec4) * 6 + sizeof(uint32_t), &push_constants
+    );
+    command_buffer.dispatch((push_constants.object_count + cull_workgroup_size - 1) / cull_workgroup_size, 1, 1);
+
+    vk::MemoryBarrier cull_barrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eIndirectCommandRead);
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eDrawIndirect, {}, cull_barrier, nullptr, nullptr);
+}
+
+// State a command buffer starts without, secondary ones inherit none of it from the primary
+void Render::bind_draw_state(vk::CommandBuffer command_buffer) {
+    // In binding order, camera uniforms then transforms
+    std::array<uint32_t, 2> dynamic_offsets = {
+        static_cast<uint32_t>(current_frame * uniform_buffer.slice_size),
+        static_cast<uint32_t>(current_frame * transform_ring.slice_size)
+    };
+    command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline_layout, 0, descriptor_set, dynamic_offsets);
+    command_buffer.bindVertexBuffers(0, vertex_buffer.buffer, {0});
+    command_buffer.bindIndexBuffer(index_buffer.buffer, 0, vk::IndexType::eUint32);
+    command_buffer.setViewport(
+        0, 
+        vk::Viewport(0.0f, 0.0f, static_cast<float>(swapchain.extent.width), static_cast<float>(swapchain.extent.height), 0.0f, 1.0f)
+    );
+    command_buffer.setScissor(0, vk::Rect2D(vk::Offset2D(0, 0), swapchain.extent));
+}
+
+// Draw items [first_item, last_item), one bind per change of pipeline and one indirect draw each. Safe to call from
+// several threads at once as long as each records into a command buffer from a different pool.
+bool Render::record_draws(vk::CommandBuffer command_buffer, size_t first_item, size_t last_item) {
+    const uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand);
+    const Frame& frame = frames[current_frame];
+    vk::Pipeline bound_pipeline {};
+    uint32_t bound_group = ~0u;
+    vk::Pipeline group_pipeline {};
+    bool complete = true;
+
+    for(size_t i = first_item; i != last_item; ++i) {
+        const DrawItem& item = draw_items[i];
+        const DrawGroup& group = draw_groups[item.group];
+        if(item.group != bound_group) {
+            // Falls back to the default variant while this one is still compiling, or to nothing when the default
+            // one can not read the group's vertex format
+            bool ready = true;
+            group_pipeline = pipelines.get(group.key, &ready);
+            complete = complete && ready;
+            if(group_pipeline && group_pipeline != bound_pipeline) {
+                command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, group_pipeline);
+                bound_pipeline = group_pipeline;
+            }
+            bound_group = item.group;
+        }
+        if(!group_pipeline) {
+            continue;
+        }
+
+        vk::DeviceSize offset = (group.first + item.first) * stride;
+        if(gpu_culling) {
+            vk::DeviceSize count_offset = i * sizeof(uint32_t);
+            if(group.indexed) {
+                command_buffer.drawIndexedIndirectCount(frame.cull_buffer, offset, frame.cull_count_buffer, count_offset, item.count, stride);
+            } else {
+                command_buffer.drawIndirectCount(frame.cull_buffer, offset, frame.cull_count_buffer, count_offset, item.count, stride);
+            }
+        } else if(group.indexed) {
+            command_buffer.drawIndexedIndirect(indirect_buffer.buffer, offset, item.count, stride);
+        } else {
+            command_buffer.drawIndirect(indirect_buffer.buffer, offset, item.count, stride);
+        }
+    }
+    return complete;
+}
+
+// Splits the draw items evenly over the job system's threads, each records its share into the secondary command
+// buffer of its own pool. Returns how many chunks the primary buffer has to execute, 0 when there are too few draws to
+// split and they are to be recorded inline. The chunks only depend on the frame slot, so they are recorded once per
+// command generation and shared by every swapchain image's primary buffer.
+uint32_t Render::record_draw_chunks(bool& complete) {
+    Frame& frame = frames[current_frame];
+    uint32_t chunks = std::min<size_t>(frame.draw_pools.size(), draw_items.size() / draw_items_per_chunk);
+    if(chunks < 2) {
+        return 0;
+    }
+    if(frame.draws_generation == command_generation && frame.draw_chunks == chunks) {
+        return chunks;
+    }
+
+    vk::CommandBufferInheritanceRenderingInfo rendering_inheritance {};
+    rendering_inheritance.colorAttachmentCount = 1;
+    rendering_inheritance.pColorAttachmentFormats = &swapchain.format;
+    rendering_inheritance.depthAttachmentFormat = vk::Format::eD16Unorm; // As created by init_depth_buffer
+    rendering_inheritance.rasterizationSamples = vk::SampleCountFlagBits::e1;
+    vk::CommandBufferInheritanceInfo inheritance {};
+    inheritance.pNext = &rendering_inheritance;
+    // Simultaneous use since the primary buffers of all swapchain images execute the same chunks
+    vk::CommandBufferBeginInfo begin_info(
+        vk::CommandBufferUsageFlagBits::eRenderPassContinue | vk::CommandBufferUsageFlagBits::eSimultaneousUse, &inheritance
+    );
+
+    // The frame fence was waited on, none of this slot's primary buffers is still pending
+    std::vector<uint8_t> chunk_complete(chunks, 1);
+    size_t item_count = draw_items.size();
+    JobSystem& jobs = job_system();
+    jobs.wait(jobs.parallel_for(0, chunks, 1, [&](size_t first, size_t last) {
+        for(size_t c = first; c != last; ++c) {
+            device.resetCommandPool(frame.draw_pools[c]);
+            vk::CommandBuffer command_buffer = frame.draw_buffers[c];
+            command_buffer.begin(begin_info);
+            bind_draw_state(command_buffer);
+            chunk_complete[c] = record_draws(command_buffer, item_count * c / chunks, item_count * (c + 1) / chunks);
+            command_buffer.end();
+        }
+    }));
+
+    for(uint8_t chunk : chunk_complete) {
+        complete = complete && chunk;
+    }
+    frame.draw_chunks = chunks;
+    frame.draws_generation = complete ? command_generation : 0;
+    command_buffer_stats.draw_chunks += chunks;
+    return chunks;
+}
+
+// Expects image in eTransferSrcOptimal, swapchain images are handed back in ePresentSrcKHR
+void Render::record_readback(vk::CommandBuffer command_buffer, vk::Image image) {
+    vk::BufferImageCopy region(
+        0, 0, 0, vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1), vk::Offset3D(0, 0, 0),
+        vk::Extent3D(swapchain.extent.width, swapchain.extent.height, 1)
+    );
+    command_buffer.copyImageToBuffer(image, vk::ImageLayout::eTransferSrcOptimal, exporter->begin_frame(), region);
+
+    vk::MemoryBarrier host_barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead);
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, host_barrier, nullptr, nullptr);
+
+    if(headless) {
+        return;
+    }
+
+    vk::ImageMemoryBarrier present_barrier {};
+    present_barrier.oldLayout = vk::ImageLayout::eTransferSrcOptimal;
+    present_barrier.newLayout = vk::ImageLayout::ePresentSrcKHR;
+    present_barrier.srcAccessMask = {};
+    present_barrier.dstAccessMask = {};
+    present_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    present_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    present_barrier.image = image;
+    present_barrier.subresourceRange = vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, nullptr, present_barrier
+    );
 }
 
+// A command buffer per frame slot and swapchain image, what a frame records only depends on those two
+// as long as nothing invalidates it. Each slot also gets a pool and a secondary buffer per job system thread for
+// recording draws in parallel.
 void Render::init_command_buffer() {
     command_pool = device.createCommandPool(vk::CommandPoolCreateInfo(vk::CommandPoolCreateFlagBits::eResetCommandBuffer, graphics_qf_index));
-    command_buffer = device.allocateCommandBuffers(vk::CommandBufferAllocateInfo(command_pool, vk::CommandBufferLevel::ePrimary, 1)).front();
+    uint32_t image_count = swapchain.images.size();
+    std::vector<vk::CommandBuffer> command_buffers = device.allocateCommandBuffers(
+        vk::CommandBufferAllocateInfo(command_pool, vk::CommandBufferLevel::ePrimary, frames_in_flight * image_count)
+    );
+
+    frames.resize(frames_in_flight);
+    for(uint32_t i = 0; i != frames_in_flight; ++i) {
+        frames[i].command_buffers.assign(command_buffers.begin() + i * image_count, command_buffers.begin() + (i + 1) * image_count);
+        frames[i].recorded_generation.assign(image_count, 0);
+        for(uint32_t t = 0; t != job_system().thread_count(); ++t) {
+            vk::CommandPool pool = device.createCommandPool(vk::CommandPoolCreateInfo({}, graphics_qf_index));
+            frames[i].draw_pools.push_back(pool);
+            frames[i].draw_buffers.push_back(
+                device.allocateCommandBuffers(vk::CommandBufferAllocateInfo(pool, vk::CommandBufferLevel::eSecondary, 1)).front()
+            );
+        }
+    }
+}
+
+// Recorded command buffers hold buffer handles, descriptor sets, draw counts, pipelines, frustum planes and the
+// extent. Anything changing one of those calls this, including a new swapchain extent once resizing exists.
+void Render::invalidate_command_buffers() {
+    ++command_generation;
+}
+
+CommandBufferStats Render::get_command_buffer_stats() const {
+    return command_buffer_stats;
+}
+
+void Render::init_sync_objects() {
+    for(auto& frame : frames) {
+        // Created signaled so the first wait on each frame returns immediately
+        frame.in_flight_fence = device.createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled));
+        if(!headless) {
+            frame.image_acquired_semaphore = device.createSemaphore(vk::SemaphoreCreateInfo());
+        }
+    }
+    if(headless) {
+        return;
+    }
+
+    // Indexed by swapchain image, a semaphore can only be reused once its present has been waited on
+    render_finished_semaphores.reserve(swapchain.images.size());
+    for(size_t i = 0; i != swapchain.images.size(); ++i) {
+        render_finished_semaphores.push_back(device.createSemaphore(vk::SemaphoreCreateInfo()));
+    }
 }
\ No newline at end of file
@@ -1,89 +1,404 @@
 #pragma once
 
 #include "vobject.h"
+#include "arena.h"
+#include "allocator.h"
+#include "pipelines.h"
+#include "export.h"
+#include "profiler.h"
 #include <string>
+#include <filesystem>
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <unordered_map>
 #include <vulkan/vulkan.hpp>
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
 
+// Refers to an object added to a Render. The generation tells a removed object's handle
+// apart from the one of a newer object that reuses its slot.
+struct ObjectHandle {
+    uint32_t index = ~0u;
+    uint32_t generation = 0;
+
+    bool valid() const { return index != ~0u; }
+};
+
+struct LoopStats {
+    uint64_t frames = 0;     // Rendered
+    uint64_t idle_wakes = 0; // Loop iterations that found nothing to draw
+    double idle_seconds = 0.0; // Blocked waiting for events
+};
+
+struct CommandBufferStats {
+    uint64_t recorded = 0;
+    uint64_t reused = 0;
+    uint64_t draw_chunks = 0; // Secondary command buffers recorded on worker threads
+};
+
 class Render {
 private:
 int width, height;
 std::string name;
-GLFWwindow* window;
+bool headless; // No window, surface or swapchain, frames are rendered into offscreen images
+GLFWwindow* window = nullptr;
 
 vk::Instance instance {};
 vk::Device device {};
 size_t graphics_qf_index {};
 vk::Queue graphics_queue {};
 vk::SurfaceKHR surface {};
+DeviceAllocator allocator;
 
+// In headless mode the images are offscreen color targets, one per frame in flight, owned by the Render
 struct {
     vk::SwapchainKHR handle;
-    std::vector<vk::Image> images {}; // Image memory handled by the swapchain
+    std::vector<vk::Image> images {}; // Image memory handled by the swapchain, or in offscreen_memory
     std::vector<vk::ImageView> image_views {};
+    std::vector<Allocation> offscreen_memory {};
     vk::Format format;
     vk::Extent2D extent;
+    bool transfer_src = false; // Images can be copied out for export
 } swapchain;
 
+// Only set while frames are being exported
+std::unique_ptr<FrameExporter> exporter;
+double export_frame_time = 0.0; // 1 / fps
+
+std::function<void(double seconds)> frame_callback;
+
+// On demand rendering, see set_on_demand
+bool on_demand = false;
+double idle_wake_interval = 0.0;
+std::atomic<bool> frame_requested {true};
+LoopStats loop_stats;
+
+// Set by enable_profiling. Each frame slot owns timestamps_per_frame queries of the pool.
+std::unique_ptr<Profiler> profiler;
+vk::QueryPool timestamp_pool {};
+double timestamp_period = 0.0; // Nanoseconds per tick
+uint64_t timestamp_mask = 0;   // Bits of a timestamp the queue writes
+
 struct {
     vk::Image image {};
-    vk::DeviceMemory memory {};
+    Allocation memory {};
     vk::ImageView image_view {};
 } depth_buffer;
 
+// Camera matrices, as read by test.vert
+struct CameraUniforms {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 view_projection;
+};
+
 struct {
     vk::Buffer buffer {};
-    vk::DeviceMemory memory {};
-    uint32_t size; // In bytes
+    Allocation memory {}; // Persistently mapped
+    uint32_t size; // In bytes, per frame
+    uint32_t slice_size; // size rounded up to minUniformBufferOffsetAlignment
 } uniform_buffer;
 
+// Model matrices by object slot, one slice per frame in flight bound with a dynamic offset. The whole
+// array is copied into the frame's slice each frame, moving an object costs its 64 bytes, not its vertices.
+struct {
+    vk::Buffer buffer {};
+    Allocation memory {}; // Persistently mapped
+    uint32_t capacity = 0; // Matrices per slice
+    vk::DeviceSize slice_size = 0; // Rounded up to minStorageBufferOffsetAlignment
+} transform_ring;
+std::vector<glm::mat4> transforms; // By object slot, the same index as ObjectData
+
 vk::DescriptorSetLayout descriptor_set_layout;
 vk::DescriptorPool descriptor_pool;
 vk::DescriptorSet descriptor_set;
 
 vk::PipelineLayout pipeline_layout;
-vk::Pipeline pipeline;
+PipelineRegistry pipelines;
+
+// Loaded at startup and written back on destruction so shaders are not recompiled on every launch
+vk::PipelineCache pipeline_cache {};
+std::filesystem::path pipeline_cache_path;
 
 vk::CommandPool command_pool;
-vk::CommandBuffer command_buffer;
 
-vk::Fence draw_fence;
-vk::Semaphore image_acquired_semaphore;
+// Everything a frame needs while the GPU may still be working on the previous ones
+struct Frame {
+    std::vector<vk::CommandBuffer> command_buffers; // By swapchain image
+    std::vector<uint64_t> recorded_generation; // command_generation each buffer was recorded at, 0 when it can not be reused
+    vk::Fence in_flight_fence {}; // Signaled once the GPU is done with this frame
+    vk::Semaphore image_acquired_semaphore {};
+    vk::DeviceSize staging_head = 0; // Staging ring position once this frame's uploads were recorded
+
+    // Draws split into chunks recorded in parallel, every chunk has its own pool so no two threads share one.
+    // Executed by all of this slot's primary buffers, whatever the swapchain image.
+    std::vector<vk::CommandPool> draw_pools;
+    std::vector<vk::CommandBuffer> draw_buffers; // Secondary, one per pool
+    uint32_t draw_chunks = 0; // Recorded at draws_generation, 0 to record the draws inline
+    uint64_t draws_generation = 0; // 0 when they have to be recorded again
+
+    uint64_t timed_frame = 0; // Frame whose timestamps this slot's queries hold once in_flight_fence signals, 0 for none
 
+    // Written by the culling pass, the visible draw commands and one visible count per draw item
+    vk::Buffer cull_buffer {};
+    Allocation cull_memory {};
+    vk::Buffer cull_count_buffer {};
+    Allocation cull_count_memory {};
+    vk::DescriptorSet cull_descriptor_set {};
+};
+
+uint32_t frames_in_flight;
+uint32_t current_frame = 0;
+std::vector<Frame> frames;
+std::vector<vk::Semaphore> render_finished_semaphores; // One per swapchain image
+
+// Bumped whenever recorded commands go stale, frames with an up to date command buffer just submit it again
+uint64_t command_generation = 1;
+CommandBufferStats command_buffer_stats;
+
+// Just what drawing and updating an object takes, its vertices only live in the vertex buffer
 struct RenderObject {
-    VObject vobject;
     uint32_t first_vertex;
+    uint32_t vertex_count;
+    glm::vec4 bounds; // Bounding sphere, xyz center and w radius
+    PipelineKey style;
+    uint32_t first_index = 0;
+    uint32_t index_count = 0; // 0 for non indexed draws
+    uint32_t object_slot = 0; // ObjectData index, passed to the vertex shader as the draw's first instance
+    glm::vec3 box_min {0.0f}; // The box quantized positions are relative to
+    glm::vec3 box_max {0.0f};
+    uint32_t generation = 0;
+    bool alive = false;
 
-    RenderObject(VObject v, uint32_t i) : vobject(v), first_vertex(i) {}
-    ~RenderObject() {} 
+    RenderObject(uint32_t i, uint32_t n, glm::vec4 b, PipelineKey k)
+        : first_vertex(i), vertex_count(n), bounds(b), style(k) {}
 };
 
-uint32_t free_vertex_mem_index = 0; // In bytes
-
+// Indexed by ObjectHandle::index, removed objects leave a dead slot behind for the next one
 std::vector<RenderObject> render_objects;
+std::vector<uint32_t> free_object_slots;
+
+// CPU copy of a dynamic object's vertices. Edits mark ranges dirty, which are uploaded once per frame.
+struct DynamicVertices {
+    std::vector<Vertex> vertices;
+    DirtyRanges dirty;
+};
+std::unordered_map<uint32_t, DynamicVertices> dynamic_vertices; // By object index
+std::vector<uint32_t> dirty_objects; // Objects with dirty ranges, each listed once
+
+// Ranges of removed objects, freed once the last frame that could have drawn them, or copied uploads into them, has completed
+struct RangeRelease {
+    uint64_t last_frame; // Submission index, counted like frames_submitted
+    RangeAllocator* ranges;
+    uint64_t offset;
+};
+std::deque<RangeRelease> range_releases;
+uint64_t frames_submitted = 0; // Across every call to loop
+
+// Integrated GPUs and CPU implementations, vertex memory can be written by the host directly
+bool unified_memory = false;
+
+// Grows by reallocation, ranges are handed out and reused through the RangeAllocator
+struct GrowableBuffer {
+    vk::DeviceSize size = 0; // In bytes
+    vk::BufferUsageFlags usage;
+    vk::Buffer buffer {};
+    Allocation memory {}; // Only mapped on unified memory, device local otherwise
+    RangeAllocator ranges;
+};
 
+GrowableBuffer vertex_buffer; // Each object's vertices in the format of its style, aligned to that format's stride
+GrowableBuffer index_buffer; // uint32_t indices, relative to their object's first vertex
+GrowableBuffer object_buffer; // ObjectData per object, bound to the graphics pipelines as a storage buffer
+
+// Lets indirect draws start at a non-zero instance, without it packed formats that need ObjectData fall back to unpacked ones
+bool draw_indirect_first_instance = false;
+bool warned_object_data = false;
+bool warned_object_transforms = false;
+
+struct StagingCopy {
+    vk::Buffer dst;
+    vk::BufferCopy region;
+};
+
+// Persistently mapped ring that uploads go through on discrete GPUs.
+// head and tail only ever increase, the position in the buffer is taken modulo size.
 struct {
-    const uint32_t size = 32 * 2048; // 2048 Vertices
+    vk::DeviceSize size = 0; // In bytes
     vk::Buffer buffer {};
-    vk::DeviceMemory memory {};
-} vertex_buffer;
+    Allocation memory {};
+    vk::DeviceSize head = 0; // Next byte to write
+    vk::DeviceSize tail = 0; // Oldest byte the GPU may still read
+    std::vector<StagingCopy> pending; // Recorded once per frame
+} staging;
+
+// Objects sharing a pipeline variant and indexed or not, their draw commands are contiguous
+struct DrawGroup {
+    PipelineKey key;
+    bool indexed;
+    uint32_t first; // First draw command
+    uint32_t count;
+};
+
+// One bind of the group's pipeline and one indirect draw of at most maxDrawIndirectCount commands, the unit draw
+// recording is split in and, with culling, the unit visible draws are counted in
+struct DrawItem {
+    uint32_t group;
+    uint32_t first; // Relative to the group's first draw command
+    uint32_t count;
+};
+
+// Per draw command, as read by cull.comp
+struct CullObject {
+    glm::vec4 sphere;
+    uint32_t batch; // Draw item, indexes the visible counts
+    uint32_t batch_first; // The batch's first draw command
+    uint32_t slot; // Transform index
+    uint32_t pad;
+};
+
+// One per render object sorted by draw group, only rebuilt and uploaded when objects change.
+// Every record is a DrawIndexedIndirectCommand, non indexed groups read its first 16 bytes as a
+// DrawIndirectCommand, so both kinds share one buffer and one culling pass.
+std::vector<vk::DrawIndexedIndirectCommand> draw_commands;
+std::vector<DrawGroup> draw_groups;
+std::vector<DrawItem> draw_items;
+bool draw_commands_dirty = false;
+
+struct {
+    vk::Buffer buffer {};
+    Allocation memory {};
+    vk::Buffer cull_objects_buffer {}; // CullObject per draw command
+    Allocation cull_objects_memory {};
+    uint32_t capacity = 0; // In draw commands
+} indirect_buffer;
+
+bool multi_draw_indirect = false;
+uint32_t max_draw_indirect_count = 1;
+
+// Frustum culling on the GPU, requires drawIndirectCount. Everything is drawn otherwise.
+bool gpu_culling = false;
+glm::mat4 view {1.0f};
+glm::mat4 projection {1.0f};
+glm::mat4 view_projection {1.0f};
+
+struct {
+    vk::DescriptorSetLayout descriptor_set_layout {};
+    vk::DescriptorPool descriptor_pool {};
+    vk::PipelineLayout pipeline_layout {};
+    vk::Pipeline pipeline {};
+} cull;
 
 public:
-    Render(int width, int height, std::string name);
-    void add_vobject(VObject v);
-    void loop();
+    Render(int width, int height, std::string name, uint32_t frames_in_flight = 2, bool headless = false);
+    // The vertices are uploaded and not kept, v can be dropped or reused right after
+    ObjectHandle add_vobject(const VObject& v, PipelineKey style = {});
+    // Vertices are stored in style.format, ColorFormat::eObject objects take the color of their first vertex.
+    // Draws count samples as a line strip. They are interleaved straight into mapped memory by the SIMD kernels,
+    // without a VObject or a std::vector<Vertex> in between.
+    ObjectHandle add_samples(
+        const float* x, const float* y, const float* z, size_t count, glm::vec4 color = glm::vec4(1.0f), PipelineKey style = {}
+    );
+    // Draws count vertices that fill writes straight into mapped memory, in chunks of [first, first + n).
+    // Lets generators such as the spline evaluators skip the intermediate vertex vector.
+    // Chunks are filled in parallel on the job system, so fill must be safe to call from several threads.
+    using VertexFill = std::function<void(Vertex* out, size_t first, size_t n)>;
+    ObjectHandle add_vertices(size_t count, glm::vec4 bounds, const VertexFill& fill, PipelineKey style = {});
+    ObjectHandle add_vsurface(const VSurface& surface, PipelineKey style = {vk::PrimitiveTopology::eTriangleList});
+    // Like add_vobject, but v's vertices are moved into a CPU copy that edit_vertices changes in place
+    ObjectHandle add_dynamic_vobject(VObject&& v, PipelineKey style = {});
+    // Vertices [first, first + count) of a dynamic object, to be written before the next frame.
+    // Only the ranges edited are uploaded, coalesced with their neighbours, so upload traffic follows what changed.
+    Vertex* edit_vertices(ObjectHandle handle, size_t first, size_t count);
+    // Overwrites vertices [first, first + count) of the object, the draw and its bounding sphere grow to cover them.
+    // Quantized positions are clamped to the box of the vertices the object was added with.
+    void update_vertices(ObjectHandle handle, size_t first, const Vertex* vertices, size_t count);
+    // Object space to world space, applied on the GPU. add_vobject starts from a translation to VObject::position.
+    void set_transform(ObjectHandle handle, const glm::mat4& model);
+    // Color of an object stored with ColorFormat::eObject, per vertex colors are not affected
+    void set_color(ObjectHandle handle, glm::vec4 color);
+    // The default identity camera passes world space through as clip space
+    void set_camera(const glm::mat4& view, const glm::mat4& projection);
+    // Stops drawing the object, its vertex, index and object data ranges are reused once no frame in flight reads them
+    void remove(ObjectHandle handle);
+    // Called at the start of every frame with the seconds since the previous one, or 1 / fps while exporting so
+    // exported animations play at their real speed. Objects can be moved and their vertices edited from it.
+    void set_frame_callback(std::function<void(double seconds)> callback);
+    // Only draws when something changed: objects, vertices, transforms, colors, the camera, or request_frame.
+    // The loop sleeps in glfwWaitEvents in between, or glfwWaitEventsTimeout when wake_interval is not 0 so the
+    // frame callback still runs that often, e.g. to poll for data. Headless rendering always draws every frame.
+    void set_on_demand(bool enabled, double wake_interval = 0.0);
+    // Makes the next loop iteration draw. Safe to call from any thread, it wakes the loop.
+    void request_frame();
+    LoopStats get_loop_stats() const;
+    // Renders until the window is closed, or frame_count frames when it is not 0
+    void loop(uint64_t frame_count = 0);
+    void print_vertex_buffer_stats();
+    // How many frames recorded their command buffer and how many submitted an already recorded one
+    CommandBufferStats get_command_buffer_stats() const;
+    // Times the loop's CPU zones of the last frame_capacity frames, and their GPU phases where the queue has timestamps
+    void enable_profiling(size_t frame_capacity = 1024);
+    // nullptr until enable_profiling
+    const Profiler* get_profiler() const;
+    // Every frame rendered from now on is read back and written to target, a path or "|command"
+    void export_frames(const std::string& target, ExportFormat format, uint32_t fps = 30);
     ~Render();
 
 private:
     void init_window();
     void init_vulkan();
     void init_swapchain();
+    void init_offscreen_targets();
     void init_depth_buffer();
     void init_uniform_buffer();
+    void init_pipeline_cache();
+    void save_pipeline_cache();
     void init_pipeline();
-    void init_vertex_buffer();
+    void init_growable_buffer(GrowableBuffer& b, vk::BufferUsageFlags usage, vk::DeviceSize size);
+    void grow_buffer(GrowableBuffer& b, vk::DeviceSize min_free_size);
+    void destroy_growable_buffer(GrowableBuffer& b);
+    void init_staging_buffer();
+    uint64_t allocate_range(GrowableBuffer& b, vk::DeviceSize size, vk::DeviceSize alignment);
+    PipelineKey supported_style(PipelineKey style);
+    uint64_t allocate_vertices(VertexFormat format, size_t count);
+    void upload_vertices(VertexFormat format, uint64_t offset, const Vertex* vertices, size_t count, glm::vec3 min, glm::vec3 max);
+    glm::vec4 stream_vertices(
+        VertexFormat format, uint64_t offset, size_t count, glm::vec3 min, glm::vec3 max, const VertexFill& fill
+    );
+    uint32_t add_object_data(glm::vec4 color, glm::vec3 min, glm::vec3 max);
+    ObjectHandle insert_object(RenderObject ro);
+    RenderObject& object(ObjectHandle handle);
+    void release_ranges();
+    void flush_dirty_vertices();
+    void write_object_descriptor();
+    void init_transform_ring(uint32_t capacity);
+    void destroy_transform_ring();
+    void write_transform_descriptors();
+    void set_slot_transform(uint32_t slot, const glm::mat4& model);
+    void write_frame_data();
+    void upload_to(GrowableBuffer& b, vk::DeviceSize offset, const void* data, vk::DeviceSize size);
+    void upload_buffer(vk::Buffer dst, vk::DeviceSize offset, const void* data, vk::DeviceSize size);
+    vk::DeviceSize allocate_staging(vk::DeviceSize size);
+    void record_uploads(vk::CommandBuffer command_buffer);
+    void flush_uploads();
+    void submit_immediate(const std::function<void(vk::CommandBuffer)>& record);
+    void init_cull_pipeline();
+    void init_indirect_buffer(uint32_t capacity);
+    void destroy_indirect_buffer();
+    void record_culling(vk::CommandBuffer command_buffer);
+    void update_draw_commands();
+    bool frame_damaged() const;
+    bool record_frame(vk::CommandBuffer command_buffer, uint32_t image_index);
+    void bind_draw_state(vk::CommandBuffer command_buffer);
+    bool record_draws(vk::CommandBuffer command_buffer, size_t first_item, size_t last_item);
+    uint32_t record_draw_chunks(bool& complete);
+    void record_readback(vk::CommandBuffer command_buffer, vk::Image image);
     void init_command_buffer();
+    void invalidate_command_buffers();
+    void read_timestamps(Frame& frame);
+    void init_sync_objects();
 };
@@ -0,0 +1,191 @@
+#include "scene.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCENE_X86 1
+#include <immintrin.h>
+#endif
+
+// Nodes per job, a node is one matrix product
+const size_t node_grain = 4096;
+
+// out = a * b, column major. out may not alias a.
+void multiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& out) {
+#ifdef SCENE_X86
+    __m128 a0 = _mm_loadu_ps(&a[0].x), a1 = _mm_loadu_ps(&a[1].x), a2 = _mm_loadu_ps(&a[2].x), a3 = _mm_loadu_ps(&a[3].x);
+    for(int c = 0; c != 4; ++c) {
+        const float* column = &b[c].x;
+        __m128 r = _mm_mul_ps(a0, _mm_set1_ps(column[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(column[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(column[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(column[3])));
+        _mm_storeu_ps(&out[c].x, r);
+    }
+#else
+    for(int c = 0; c != 4; ++c) {
+        out[c] = a[0] * b[c].x + a[1] * b[c].y + a[2] * b[c].z + a[3] * b[c].w;
+    }
+#endif
+}
+
+SceneNode SceneGraph::add(SceneNode parent_node, const glm::mat4& local_matrix, ObjectHandle attached) {
+    uint32_t parent_slot = ~0u;
+    uint32_t node_depth = 0;
+    if(parent_node != no_scene_node) {
+        if(parent_node >= slot_of_node.size()) {
+            std::cerr << "Scene node " << parent_node << " does not exist\n";
+            std::exit(EXIT_FAILURE);
+        }
+        parent_slot = slot_of_node[parent_node];
+        node_depth = depth[parent_slot] + 1;
+    }
+
+    SceneNode node = slot_of_node.size();
+    // Appending keeps the order sorted unless the node is shallower than the last one
+    if(!depth.empty() && node_depth < depth.back()) {
+        sorted = false;
+    }
+    slot_of_node.push_back(parent.size());
+    parent.push_back(parent_slot);
+    depth.push_back(node_depth);
+    local.push_back(local_matrix);
+    world_matrices.push_back(glm::mat4(1.0f));
+    object.push_back(attached);
+    dirty.push_back(1);
+    changed.push_back(0);
+    queued.push_back(0);
+    min_dirty_depth = std::min(min_dirty_depth, node_depth);
+    return node;
+}
+
+void SceneGraph::set_local(SceneNode node, const glm::mat4& local_matrix) {
+    uint32_t slot = slot_of_node[node];
+    local[slot] = local_matrix;
+    dirty[slot] = 1;
+    min_dirty_depth = std::min(min_dirty_depth, depth[slot]);
+}
+
+void SceneGraph::attach(SceneNode node, ObjectHandle attached) {
+    uint32_t slot = slot_of_node[node];
+    object[slot] = attached;
+    // Picks up the current world matrix on the next apply
+    if(!queued[slot]) {
+        queued[slot] = 1;
+        apply_slots.push_back(slot);
+    }
+}
+
+// Stable, so siblings keep the order they were added in
+void SceneGraph::sort_by_depth() {
+    std::vector<uint32_t> order(parent.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+        return depth[a] < depth[b];
+    });
+    std::vector<uint32_t> new_slot(order.size());
+    for(uint32_t i = 0; i != order.size(); ++i) {
+        new_slot[order[i]] = i;
+    }
+
+    auto permute = [&order](auto& v) {
+        std::remove_reference_t<decltype(v)> sorted_v(v.size());
+        for(uint32_t i = 0; i != order.size(); ++i) {
+            sorted_v[i] = v[order[i]];
+        }
+        v.swap(sorted_v);
+    };
+    permute(parent);
+    permute(depth);
+    permute(local);
+    permute(world_matrices);
+    permute(object);
+    permute(dirty);
+    permute(changed);
+    permute(queued);
+    for(uint32_t& p : parent) {
+        if(p != ~0u) {
+            p = new_slot[p];
+        }
+    }
+    for(uint32_t& slot : slot_of_node) {
+        slot = new_slot[slot];
+    }
+    for(uint32_t& slot : apply_slots) {
+        slot = new_slot[slot];
+    }
+    sorted = true;
+}
+
+// A node is recomputed when its own local matrix or its parent's world matrix changed
+void SceneGraph::update_level(size_t first, size_t last) {
+    for(size_t i = first; i != last; ++i) {
+        uint32_t p = parent[i];
+        bool parent_changed = p != ~0u && changed[p];
+        if(!dirty[i] && !parent_changed) {
+            continue;
+        }
+        if(p == ~0u) {
+            world_matrices[i] = local[i];
+        } else {
+            multiply(world_matrices[p], local[i], world_matrices[i]);
+        }
+        dirty[i] = 0;
+        changed[i] = 1;
+    }
+}
+
+void SceneGraph::update(JobSystem& jobs) {
+    updated = 0;
+    if(min_dirty_depth == ~0u) {
+        return;
+    }
+    if(!sorted) {
+        sort_by_depth();
+    }
+
+    // Nodes are only ever added, so the levels are current while they cover every node
+    if(level_first.empty() || level_first.back() != depth.size()) {
+        level_first.clear();
+        for(uint32_t i = 0; i != depth.size(); ++i) {
+            while(level_first.size() <= depth[i]) {
+                level_first.push_back(i);
+            }
+        }
+        level_first.push_back(depth.size());
+    }
+
+    // Levels above the shallowest dirty node can not change, so they are not even looked at
+    JobHandle previous;
+    for(uint32_t d = min_dirty_depth; d + 1 < level_first.size(); ++d) {
+        previous = jobs.parallel_for(level_first[d], level_first[d + 1], node_grain, [this](size_t first, size_t last) {
+            update_level(first, last);
+        }, {previous});
+    }
+    jobs.wait(previous);
+
+    for(size_t i = level_first[min_dirty_depth]; i != changed.size(); ++i) {
+        if(!changed[i]) {
+            continue;
+        }
+        changed[i] = 0;
+        ++updated;
+        if(object[i].valid() && !queued[i]) {
+            queued[i] = 1;
+            apply_slots.push_back(i);
+        }
+    }
+    min_dirty_depth = ~0u;
+}
+
+void SceneGraph::apply(Render& render) {
+    for(uint32_t slot : apply_slots) {
+        if(object[slot].valid()) {
+            render.set_transform(object[slot], world_matrices[slot]);
+        }
+        queued[slot] = 0;
+    }
+    apply_slots.clear();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "render.h"
+#include "jobs.h"
+#include <cstdint>
+#include <vector>
+
+using SceneNode = uint32_t;
+const SceneNode no_scene_node = ~0u;
+
+// Transform hierarchy over render objects. Nodes live in flat arrays sorted by depth, so every parent comes
+// before its children and each depth level can be computed in parallel once the one above it is done.
+// World matrices are only recomputed below nodes whose local matrix changed, and only those reach Render.
+class SceneGraph {
+public:
+    // parent must already exist. Nodes are never removed, detach their object instead.
+    SceneNode add(SceneNode parent = no_scene_node, const glm::mat4& local = glm::mat4(1.0f), ObjectHandle object = {});
+    void set_local(SceneNode node, const glm::mat4& local);
+    // An empty handle detaches the node's object, which keeps its last transform
+    void attach(SceneNode node, ObjectHandle object);
+    // As of the last update
+    const glm::mat4& world(SceneNode node) const { return world_matrices[slot_of_node[node]]; }
+
+    // Recomputes world matrices of changed nodes and their descendants
+    void update(JobSystem& jobs = job_system());
+    // Hands the world matrices update changed to the objects attached to them
+    void apply(Render& render);
+
+    size_t size() const { return slot_of_node.size(); }
+    // Nodes the last update recomputed
+    size_t updated_count() const { return updated; }
+
+private:
+    // By node id, which stays fixed while the arrays below are re-sorted
+    std::vector<uint32_t> slot_of_node;
+
+    // By slot, sorted by depth
+    std::vector<uint32_t> parent;  // Slot, ~0u for roots
+    std::vector<uint32_t> depth;
+    std::vector<glm::mat4> local;
+    std::vector<glm::mat4> world_matrices;
+    std::vector<ObjectHandle> object;
+    std::vector<uint8_t> dirty;    // Local matrix was set since the last update
+    std::vector<uint8_t> changed;  // World matrix recomputed by the running update, all clear between updates
+    std::vector<uint8_t> queued;   // In apply_slots
+    std::vector<uint32_t> apply_slots; // Nodes with objects whose world matrix Render has not seen yet
+
+    std::vector<uint32_t> level_first; // Slots of depth d are [level_first[d], level_first[d + 1])
+    bool sorted = true;
+    uint32_t min_dirty_depth = ~0u;
+    size_t updated = 0;
+
+    void sort_by_depth();
+    void update_level(size_t first, size_t last);
+};
@@ -0,0 +1,200 @@
+#include "soa.h"
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SOA_X86 1
+#include <immintrin.h>
+#endif
+
+void soa_to_vertices_scalar(
+    const float* x, const float* y, const float* z, size_t count, glm::vec4 color, Vertex* out, glm::vec3& min, glm::vec3& max
+) {
+    for(size_t i = 0; i != count; ++i) {
+        glm::vec3 p(x[i], y[i], z[i]);
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+        out[i].position = glm::vec4(p, 1.0f);
+        out[i].color = color;
+    }
+}
+
+#ifdef SOA_X86
+
+// Non-temporal stores skip reading the destination lines into the cache first, which is most of the
+// memory traffic here. They need aligned addresses, unaligned destinations use regular stores.
+inline void store4(float* p, __m128 v, bool stream) {
+    if(stream) {
+        _mm_stream_ps(p, v);
+    } else {
+        _mm_storeu_ps(p, v);
+    }
+}
+
+// Vertices are 32 bytes, so a 16 byte aligned destination still streams, as two halves
+__attribute__((target("avx2")))
+inline void store8(float* p, __m256 v, bool stream, bool stream256) {
+    if(stream256) {
+        _mm256_stream_ps(p, v);
+    } else if(stream) {
+        _mm_stream_ps(p, _mm256_castps256_ps128(v));
+        _mm_stream_ps(p + 4, _mm256_extractf128_ps(v, 1));
+    } else {
+        _mm256_storeu_ps(p, v);
+    }
+}
+
+// Four points per iteration, transposed from xxxx yyyy zzzz 1111 into xyz1 per vertex
+void soa_to_vertices_sse(
+    const float* x, const float* y, const float* z, size_t count, glm::vec4 color, Vertex* out, glm::vec3& min, glm::vec3& max
+) {
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 c = _mm_loadu_ps(&color.x);
+    __m128 min_x = _mm_set1_ps(min.x), min_y = _mm_set1_ps(min.y), min_z = _mm_set1_ps(min.z);
+    __m128 max_x = _mm_set1_ps(max.x), max_y = _mm_set1_ps(max.y), max_z = _mm_set1_ps(max.z);
+    float* dst = &out[0].position.x;
+    bool stream = reinterpret_cast<uintptr_t>(dst) % 16 == 0;
+
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        __m128 vx = _mm_loadu_ps(x + i);
+        __m128 vy = _mm_loadu_ps(y + i);
+        __m128 vz = _mm_loadu_ps(z + i);
+        min_x = _mm_min_ps(min_x, vx); max_x = _mm_max_ps(max_x, vx);
+        min_y = _mm_min_ps(min_y, vy); max_y = _mm_max_ps(max_y, vy);
+        min_z = _mm_min_ps(min_z, vz); max_z = _mm_max_ps(max_z, vz);
+
+        __m128 xy_lo = _mm_unpacklo_ps(vx, vy); // x0 y0 x1 y1
+        __m128 xy_hi = _mm_unpackhi_ps(vx, vy); // x2 y2 x3 y3
+        __m128 zw_lo = _mm_unpacklo_ps(vz, one); // z0 1 z1 1
+        __m128 zw_hi = _mm_unpackhi_ps(vz, one); // z2 1 z3 1
+
+        float* v = dst + i * 8;
+        store4(v + 0, _mm_movelh_ps(xy_lo, zw_lo), stream);
+        store4(v + 4, c, stream);
+        store4(v + 8, _mm_movehl_ps(zw_lo, xy_lo), stream);
+        store4(v + 12, c, stream);
+        store4(v + 16, _mm_movelh_ps(xy_hi, zw_hi), stream);
+        store4(v + 20, c, stream);
+        store4(v + 24, _mm_movehl_ps(zw_hi, xy_hi), stream);
+        store4(v + 28, c, stream);
+    }
+
+    _mm_sfence();
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, min_x); min.x = *std::min_element(lanes, lanes + 4);
+    _mm_storeu_ps(lanes, min_y); min.y = *std::min_element(lanes, lanes + 4);
+    _mm_storeu_ps(lanes, min_z); min.z = *std::min_element(lanes, lanes + 4);
+    _mm_storeu_ps(lanes, max_x); max.x = *std::max_element(lanes, lanes + 4);
+    _mm_storeu_ps(lanes, max_y); max.y = *std::max_element(lanes, lanes + 4);
+    _mm_storeu_ps(lanes, max_z); max.z = *std::max_element(lanes, lanes + 4);
+
+    soa_to_vertices_scalar(x + i, y + i, z + i, count - i, color, out + i, min, max);
+}
+
+// Eight points per iteration, a whole 32 byte vertex is one store
+__attribute__((target("avx2")))
+void soa_to_vertices_avx2(
+    const float* x, const float* y, const float* z, size_t count, glm::vec4 color, Vertex* out, glm::vec3& min, glm::vec3& max
+) {
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 c = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(&color.x));
+    __m256 min_x = _mm256_set1_ps(min.x), min_y = _mm256_set1_ps(min.y), min_z = _mm256_set1_ps(min.z);
+    __m256 max_x = _mm256_set1_ps(max.x), max_y = _mm256_set1_ps(max.y), max_z = _mm256_set1_ps(max.z);
+    float* dst = &out[0].position.x;
+    bool stream = reinterpret_cast<uintptr_t>(dst) % 16 == 0;
+    bool stream256 = reinterpret_cast<uintptr_t>(dst) % 32 == 0;
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        __m256 vy = _mm256_loadu_ps(y + i);
+        __m256 vz = _mm256_loadu_ps(z + i);
+        min_x = _mm256_min_ps(min_x, vx); max_x = _mm256_max_ps(max_x, vx);
+        min_y = _mm256_min_ps(min_y, vy); max_y = _mm256_max_ps(max_y, vy);
+        min_z = _mm256_min_ps(min_z, vz); max_z = _mm256_max_ps(max_z, vz);
+
+        // Unpacks work per 128 bit lane, so the low lane holds points 0-3 and the high lane points 4-7
+        __m256 xy_lo = _mm256_unpacklo_ps(vx, vy); // x0 y0 x1 y1 | x4 y4 x5 y5
+        __m256 xy_hi = _mm256_unpackhi_ps(vx, vy); // x2 y2 x3 y3 | x6 y6 x7 y7
+        __m256 zw_lo = _mm256_unpacklo_ps(vz, one);
+        __m256 zw_hi = _mm256_unpackhi_ps(vz, one);
+
+        __m256 p04 = _mm256_shuffle_ps(xy_lo, zw_lo, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 p15 = _mm256_shuffle_ps(xy_lo, zw_lo, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 p26 = _mm256_shuffle_ps(xy_hi, zw_hi, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 p37 = _mm256_shuffle_ps(xy_hi, zw_hi, _MM_SHUFFLE(3, 2, 3, 2));
+
+        float* v = dst + i * 8;
+        store8(v + 0, _mm256_permute2f128_ps(p04, c, 0x20), stream, stream256);
+        store8(v + 8, _mm256_permute2f128_ps(p15, c, 0x20), stream, stream256);
+        store8(v + 16, _mm256_permute2f128_ps(p26, c, 0x20), stream, stream256);
+        store8(v + 24, _mm256_permute2f128_ps(p37, c, 0x20), stream, stream256);
+        store8(v + 32, _mm256_permute2f128_ps(p04, c, 0x31), stream, stream256);
+        store8(v + 40, _mm256_permute2f128_ps(p15, c, 0x31), stream, stream256);
+        store8(v + 48, _mm256_permute2f128_ps(p26, c, 0x31), stream, stream256);
+        store8(v + 56, _mm256_permute2f128_ps(p37, c, 0x31), stream, stream256);
+    }
+
+    _mm_sfence();
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, min_x); min.x = *std::min_element(lanes, lanes + 8);
+    _mm256_storeu_ps(lanes, min_y); min.y = *std::min_element(lanes, lanes + 8);
+    _mm256_storeu_ps(lanes, min_z); min.z = *std::min_element(lanes, lanes + 8);
+    _mm256_storeu_ps(lanes, max_x); max.x = *std::max_element(lanes, lanes + 8);
+    _mm256_storeu_ps(lanes, max_y); max.y = *std::max_element(lanes, lanes + 8);
+    _mm256_storeu_ps(lanes, max_z); max.z = *std::max_element(lanes, lanes + 8);
+
+    soa_to_vertices_scalar(x + i, y + i, z + i, count - i, color, out + i, min, max);
+}
+
+#endif
+
+SoaKernel best_soa_kernel() {
+#ifdef SOA_X86
+    static const SoaKernel kernel = __builtin_cpu_supports("avx2") ? SoaKernel::eAVX2 : SoaKernel::eSSE;
+    return kernel;
+#else
+    return SoaKernel::eScalar;
+#endif
+}
+
+const char* soa_kernel_name(SoaKernel kernel) {
+    switch(kernel) {
+        case SoaKernel::eScalar:
+            return "scalar";
+        case SoaKernel::eSSE:
+            return "sse";
+        case SoaKernel::eAVX2:
+            return "avx2";
+    }
+    return "unknown";
+}
+
+void soa_to_vertices(
+    const float* x, const float* y, const float* z, size_t count, glm::vec4 color, Vertex* out, glm::vec3& min, glm::vec3& max
+) {
+    soa_to_vertices(best_soa_kernel(), x, y, z, count, color, out, min, max);
+}
+
+// Kernels the CPU does not support fall back to the best one it does
+void soa_to_vertices(
+    SoaKernel kernel, const float* x, const float* y, const float* z, size_t count, glm::vec4 color, Vertex* out,
+    glm::vec3& min, glm::vec3& max
+) {
+#ifdef SOA_X86
+    if(kernel == SoaKernel::eAVX2 && best_soa_kernel() == SoaKernel::eAVX2) {
+        soa_to_vertices_avx2(x, y, z, count, color, out, min, max);
+        return;
+    }
+    if(kernel != SoaKernel::eScalar) {
+        soa_to_vertices_sse(x, y, z, count, color, out, min, max);
+        return;
+    }
+#else
+    (void)kernel;
+#endif
+    soa_to_vertices_scalar(x, y, z, count, color, out, min, max);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "vobject.h"
+#include <cstddef>
+
+enum class SoaKernel {
+    eScalar,
+    eSSE,  // SSE2, always there on x86-64
+    eAVX2
+};
+
+// Fastest kernel the CPU supports, checked once
+SoaKernel best_soa_kernel();
+const char* soa_kernel_name(SoaKernel kernel);
+
+// Interleaves x, y, z into count vertices with w = 1 and the given color, and grows [min, max] to cover them.
+// out may be write-combined mapped memory, it is only ever written to, front to back.
+void soa_to_vertices(
+    const float* x, const float* y, const float* z, size_t count, glm::vec4 color, Vertex* out, glm::vec3& min, glm::vec3& max
+);
+void soa_to_vertices(
+    SoaKernel kernel, const float* x, const float* y, const float* z, size_t count, glm::vec4 color, Vertex* out,
+    glm::vec3& min, glm::vec3& max
+);
@@ -0,0 +1,351 @@
+#include "spline.h"
+#include "soa.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+// Compiled twice, the AVX2 clone is picked at load time on CPUs that support it
+#define SPLINE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define SPLINE_KERNEL
+#endif
+
+const size_t lane_count = 8;
+typedef float lanes __attribute__((vector_size(lane_count * sizeof(float))));
+// Parameters evaluated before each soa_to_vertices call
+const size_t block_size = 256;
+
+// The evaluators keep degree + 1 basis functions in fixed size arrays on the stack,
+// and a curve of degree d needs at least d + 1 control points to have a span at all
+void check_curve(size_t n, uint32_t degree) {
+    if(degree > max_spline_degree) {
+        std::cerr << "Spline degree " << degree << " is above the supported maximum of " << max_spline_degree << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if(n < size_t(degree) + 1) {
+        std::cerr << "Spline of degree " << degree << " needs at least " << degree + 1 << " control points, got " << n << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+std::vector<float> clamped_uniform_knots(size_t n, uint32_t degree) {
+    check_curve(n, degree);
+    std::vector<float> knots(n + degree + 1);
+    float spans = static_cast<float>(n - degree);
+    for(size_t i = 0; i != knots.size(); ++i) {
+        float k = (static_cast<float>(i) - static_cast<float>(degree)) / spans;
+        knots[i] = std::clamp(k, 0.0f, 1.0f);
+    }
+    return knots;
+}
+
+glm::vec4 control_bounds(const glm::vec3* control, size_t n) {
+    glm::vec3 min(std::numeric_limits<float>::max());
+    glm::vec3 max(std::numeric_limits<float>::lowest());
+    for(size_t i = 0; i != n; ++i) {
+        min = glm::min(min, control[i]);
+        max = glm::max(max, control[i]);
+    }
+
+    glm::vec3 center = (min + max) * 0.5f;
+    float radius = 0.0f;
+    for(size_t i = 0; i != n; ++i) {
+        radius = std::max(radius, glm::length(control[i] - center));
+    }
+    return glm::vec4(center, radius);
+}
+
+// Knot span holding t, clamped to the curve's domain
+size_t find_span(const float* knots, size_t n, uint32_t degree, float t) {
+    if(t >= knots[n]) {
+        return n - 1;
+    }
+    if(t <= knots[degree]) {
+        return degree;
+    }
+    return std::upper_bound(knots + degree, knots + n + 1, t) - knots - 1;
+}
+
+// The degree + 1 nonzero basis functions at t, Cox-de Boor as in The NURBS Book, A2.2
+void basis_functions(const float* knots, size_t span, uint32_t degree, float t, float* N) {
+    assert(degree <= max_spline_degree);
+    float left[max_spline_degree + 1];
+    float right[max_spline_degree + 1];
+    N[0] = 1.0f;
+    for(uint32_t j = 1; j <= degree; ++j) {
+        left[j] = t - knots[span + 1 - j];
+        right[j] = knots[span + j] - t;
+        float saved = 0.0f;
+        for(uint32_t r = 0; r < j; ++r) {
+            float temp = N[r] / (right[r + 1] + left[j - r]);
+            N[r] = saved + right[r + 1] * temp;
+            saved = left[j - r] * temp;
+        }
+        N[j] = saved;
+    }
+}
+
+void write_vertices(const float* xs, const float* ys, const float* zs, size_t count, glm::vec4 color, Vertex* out) {
+    glm::vec3 min(0.0f);
+    glm::vec3 max(0.0f);
+    soa_to_vertices(xs, ys, zs, count, color, out, min, max);
+}
+
+SPLINE_KERNEL
+void eval_bezier(const glm::vec3* control, const float* t, size_t count, glm::vec4 color, Vertex* out) {
+    // Power basis, evaluated with Horner's rule
+    glm::vec3 c3 = control[3] - control[0] + 3.0f * (control[1] - control[2]);
+    glm::vec3 c2 = 3.0f * (control[0] - 2.0f * control[1] + control[2]);
+    glm::vec3 c1 = 3.0f * (control[1] - control[0]);
+    glm::vec3 c0 = control[0];
+
+    float xs[block_size], ys[block_size], zs[block_size];
+    for(size_t base = 0; base < count; base += block_size) {
+        size_t m = std::min(block_size, count - base);
+        for(size_t i = 0; i < m; i += lane_count) {
+            // Lanes past the end repeat the last parameter and are not stored
+            size_t active = std::min(lane_count, m - i);
+            lanes u;
+            for(size_t l = 0; l != lane_count; ++l) {
+                u[l] = t[base + i + std::min(l, active - 1)];
+            }
+
+            lanes x = ((c3.x * u + c2.x) * u + c1.x) * u + c0.x;
+            lanes y = ((c3.y * u + c2.y) * u + c1.y) * u + c0.y;
+            lanes z = ((c3.z * u + c2.z) * u + c1.z) * u + c0.z;
+            for(size_t l = 0; l != active; ++l) {
+                xs[i + l] = x[l];
+                ys[i + l] = y[l];
+                zs[i + l] = z[l];
+            }
+        }
+        write_vertices(xs, ys, zs, m, color, out + base);
+    }
+}
+
+// B-spline when control4 is null, NURBS when control3 is null. One lane per parameter, each with its own span.
+SPLINE_KERNEL
+void eval_spline(
+    const glm::vec3* control3, const glm::vec4* control4, size_t n, uint32_t degree, const float* knots,
+    const float* t, size_t count, glm::vec4 color, Vertex* out
+) {
+    assert(degree <= max_spline_degree);
+    float xs[block_size], ys[block_size], zs[block_size];
+    for(size_t base = 0; base < count; base += block_size) {
+        size_t m = std::min(block_size, count - base);
+        for(size_t i = 0; i < m; i += lane_count) {
+            size_t active = std::min(lane_count, m - i);
+            lanes u;
+            size_t span[lane_count];
+            for(size_t l = 0; l != lane_count; ++l) {
+                u[l] = t[base + i + std::min(l, active - 1)];
+                span[l] = find_span(knots, n, degree, u[l]);
+            }
+
+            lanes N[max_spline_degree + 1];
+            lanes left[max_spline_degree + 1];
+            lanes right[max_spline_degree + 1];
+            N[0] = lanes {} + 1.0f;
+            for(uint32_t j = 1; j <= degree; ++j) {
+                for(size_t l = 0; l != lane_count; ++l) {
+                    left[j][l] = u[l] - knots[span[l] + 1 - j];
+                    right[j][l] = knots[span[l] + j] - u[l];
+                }
+                lanes saved = {};
+                for(uint32_t r = 0; r < j; ++r) {
+                    lanes temp = N[r] / (right[r + 1] + left[j - r]);
+                    N[r] = saved + right[r + 1] * temp;
+                    saved = left[j - r] * temp;
+                }
+                N[j] = saved;
+            }
+
+            lanes x = {}, y = {}, z = {}, w = {};
+            for(uint32_t j = 0; j <= degree; ++j) {
+                lanes cx, cy, cz, cw;
+                for(size_t l = 0; l != lane_count; ++l) {
+                    size_t k = span[l] - degree + j;
+                    if(control4) {
+                        // Homogeneous coordinates, divided by the summed weight below
+                        cw[l] = control4[k].w;
+                        cx[l] = control4[k].x * cw[l];
+                        cy[l] = control4[k].y * cw[l];
+                        cz[l] = control4[k].z * cw[l];
+                    } else {
+                        cx[l] = control3[k].x;
+                        cy[l] = control3[k].y;
+                        cz[l] = control3[k].z;
+                        cw[l] = 1.0f;
+                    }
+                }
+                x += N[j] * cx;
+                y += N[j] * cy;
+                z += N[j] * cz;
+                w += N[j] * cw;
+            }
+            if(control4) {
+                x /= w;
+                y /= w;
+                z /= w;
+            }
+
+            for(size_t l = 0; l != active; ++l) {
+                xs[i + l] = x[l];
+                ys[i + l] = y[l];
+                zs[i + l] = z[l];
+            }
+        }
+        write_vertices(xs, ys, zs, m, color, out + base);
+    }
+}
+
+void eval_bspline(
+    const glm::vec3* control, size_t n, uint32_t degree, const float* knots, const float* t, size_t count, glm::vec4 color, Vertex* out
+) {
+    check_curve(n, degree);
+    eval_spline(control, nullptr, n, degree, knots, t, count, color, out);
+}
+
+void eval_nurbs(
+    const glm::vec4* control, size_t n, uint32_t degree, const float* knots, const float* t, size_t count, glm::vec4 color, Vertex* out
+) {
+    check_curve(n, degree);
+    eval_spline(nullptr, control, n, degree, knots, t, count, color, out);
+}
+
+// de Casteljau, one lane per curve
+SPLINE_KERNEL
+void eval_bezier_batch(const glm::vec3* control, size_t curve_count, const float* t, size_t count, glm::vec4 color, Vertex* out) {
+    static thread_local float xs[lane_count][block_size], ys[lane_count][block_size], zs[lane_count][block_size];
+
+    for(size_t first = 0; first < curve_count; first += lane_count) {
+        size_t active = std::min(lane_count, curve_count - first);
+        lanes cx[4], cy[4], cz[4];
+        for(size_t k = 0; k != 4; ++k) {
+            for(size_t l = 0; l != lane_count; ++l) {
+                const glm::vec3& p = control[(first + std::min(l, active - 1)) * 4 + k];
+                cx[k][l] = p.x;
+                cy[k][l] = p.y;
+                cz[k][l] = p.z;
+            }
+        }
+
+        for(size_t base = 0; base < count; base += block_size) {
+            size_t m = std::min(block_size, count - base);
+            for(size_t i = 0; i != m; ++i) {
+                float u = t[base + i];
+                lanes qx[4] = {cx[0], cx[1], cx[2], cx[3]};
+                lanes qy[4] = {cy[0], cy[1], cy[2], cy[3]};
+                lanes qz[4] = {cz[0], cz[1], cz[2], cz[3]};
+                for(size_t r = 1; r != 4; ++r) {
+                    for(size_t k = 0; k != 4 - r; ++k) {
+                        qx[k] += (qx[k + 1] - qx[k]) * u;
+                        qy[k] += (qy[k + 1] - qy[k]) * u;
+                        qz[k] += (qz[k + 1] - qz[k]) * u;
+                    }
+                }
+                for(size_t l = 0; l != active; ++l) {
+                    xs[l][i] = qx[0][l];
+                    ys[l][i] = qy[0][l];
+                    zs[l][i] = qz[0][l];
+                }
+            }
+            for(size_t l = 0; l != active; ++l) {
+                write_vertices(xs[l], ys[l], zs[l], m, color, out + (first + l) * count + base);
+            }
+        }
+    }
+}
+
+// With shared knots the span and basis functions only depend on the parameter, so they are computed
+// once per parameter and the weighted sum of control points runs one lane per curve
+SPLINE_KERNEL
+void eval_spline_batch(
+    const glm::vec3* control3, const glm::vec4* control4, size_t curve_count, size_t n, uint32_t degree, const float* knots,
+    const float* t, size_t count, glm::vec4 color, Vertex* out
+) {
+    assert(degree <= max_spline_degree);
+    static thread_local float xs[lane_count][block_size], ys[lane_count][block_size], zs[lane_count][block_size];
+    // Transposed control points, lane_count floats per control point. Plain floats since
+    // std::vector does not guarantee the alignment of vector types.
+    std::vector<float> cx(n * lane_count), cy(n * lane_count), cz(n * lane_count), cw(n * lane_count);
+
+    for(size_t first = 0; first < curve_count; first += lane_count) {
+        size_t active = std::min(lane_count, curve_count - first);
+        for(size_t k = 0; k != n; ++k) {
+            for(size_t l = 0; l != lane_count; ++l) {
+                size_t index = (first + std::min(l, active - 1)) * n + k;
+                size_t lane = k * lane_count + l;
+                if(control4) {
+                    cw[lane] = control4[index].w;
+                    cx[lane] = control4[index].x * cw[lane];
+                    cy[lane] = control4[index].y * cw[lane];
+                    cz[lane] = control4[index].z * cw[lane];
+                } else {
+                    cx[lane] = control3[index].x;
+                    cy[lane] = control3[index].y;
+                    cz[lane] = control3[index].z;
+                    cw[lane] = 1.0f;
+                }
+            }
+        }
+
+        for(size_t base = 0; base < count; base += block_size) {
+            size_t m = std::min(block_size, count - base);
+            for(size_t i = 0; i != m; ++i) {
+                float u = t[base + i];
+                size_t span = find_span(knots, n, degree, u);
+                float N[max_spline_degree + 1];
+                basis_functions(knots, span, degree, u, N);
+
+                lanes x = {}, y = {}, z = {}, w = {};
+                for(uint32_t j = 0; j <= degree; ++j) {
+                    size_t lane = (span - degree + j) * lane_count;
+                    lanes px, py, pz, pw;
+                    memcpy(&px, &cx[lane], sizeof(lanes));
+                    memcpy(&py, &cy[lane], sizeof(lanes));
+                    memcpy(&pz, &cz[lane], sizeof(lanes));
+                    memcpy(&pw, &cw[lane], sizeof(lanes));
+                    x += N[j] * px;
+                    y += N[j] * py;
+                    z += N[j] * pz;
+                    w += N[j] * pw;
+                }
+                if(control4) {
+                    x /= w;
+                    y /= w;
+                    z /= w;
+                }
+
+                for(size_t l = 0; l != active; ++l) {
+                    xs[l][i] = x[l];
+                    ys[l][i] = y[l];
+                    zs[l][i] = z[l];
+                }
+            }
+            for(size_t l = 0; l != active; ++l) {
+                write_vertices(xs[l], ys[l], zs[l], m, color, out + (first + l) * count + base);
+            }
+        }
+    }
+}
+
+void eval_bspline_batch(
+    const glm::vec3* control, size_t curve_count, size_t n, uint32_t degree, const float* knots,
+    const float* t, size_t count, glm::vec4 color, Vertex* out
+) {
+    check_curve(n, degree);
+    eval_spline_batch(control, nullptr, curve_count, n, degree, knots, t, count, color, out);
+}
+
+void eval_nurbs_batch(
+    const glm::vec4* control, size_t curve_count, size_t n, uint32_t degree, const float* knots,
+    const float* t, size_t count, glm::vec4 color, Vertex* out
+) {
+    check_curve(n, degree);
+    eval_spline_batch(nullptr, control, curve_count, n, degree, knots, t, count, color, out);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "vobject.h"
+#include <cstddef>
+#include <vector>
+
+// Batched evaluation of Bézier, B-spline and NURBS curves.
+// Single curve functions run eight parameters at a time in SIMD lanes, the batch functions run eight
+// curves at a time. Results go through soa_to_vertices, so out can point into mapped GPU memory.
+
+// Degrees up to this are supported by the B-spline and NURBS functions, higher ones are rejected, as are
+// curves with fewer than degree + 1 control points
+const uint32_t max_spline_degree = 7;
+
+// n + degree + 1 knots, uniform and clamped so the curve starts and ends on the end control points
+std::vector<float> clamped_uniform_knots(size_t n, uint32_t degree);
+
+// Sphere around the control points, which contains the curve for Bézier, B-spline and positively weighted NURBS
+glm::vec4 control_bounds(const glm::vec3* control, size_t n);
+
+// Cubic Bézier from 4 control points, at count parameters in [0, 1]
+void eval_bezier(const glm::vec3* control, const float* t, size_t count, glm::vec4 color, Vertex* out);
+// n control points, n + degree + 1 knots, parameters in [knots[degree], knots[n]].
+// Parameters do not need to be sorted, but sorted ones keep the control points each block touches in cache.
+void eval_bspline(
+    const glm::vec3* control, size_t n, uint32_t degree, const float* knots, const float* t, size_t count, glm::vec4 color, Vertex* out
+);
+// Control points are xyz and a weight in w
+void eval_nurbs(
+    const glm::vec4* control, size_t n, uint32_t degree, const float* knots, const float* t, size_t count, glm::vec4 color, Vertex* out
+);
+
+// curve_count curves sharing parameters, and knots for B-splines and NURBS. Curve c uses control[c * n, (c + 1) * n)
+// (n = 4 for Bézier) and writes out[c * count, (c + 1) * count).
+void eval_bezier_batch(const glm::vec3* control, size_t curve_count, const float* t, size_t count, glm::vec4 color, Vertex* out);
+void eval_bspline_batch(
+    const glm::vec3* control, size_t curve_count, size_t n, uint32_t degree, const float* knots,
+    const float* t, size_t count, glm::vec4 color, Vertex* out
+);
+void eval_nurbs_batch(
+    const glm::vec4* control, size_t curve_count, size_t n, uint32_t degree, const float* knots,
+    const float* t, size_t count, glm::vec4 color, Vertex* out
+);
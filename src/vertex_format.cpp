@@ -0,0 +1,155 @@
+#include "vertex_format.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VERTEX_FORMAT_X86 1
+#include <immintrin.h>
+#endif
+
+uint32_t VertexFormat::position_size() const {
+    switch(position) {
+        case PositionFormat::eFloat4:
+            return 16;
+        case PositionFormat::eFloat3:
+            return 12;
+        case PositionFormat::eHalf4:
+        case PositionFormat::eQuantized16:
+            return 8;
+    }
+    return 16;
+}
+
+uint32_t VertexFormat::color_size() const {
+    switch(color) {
+        case ColorFormat::eFloat4:
+            return 16;
+        case ColorFormat::eUnorm8:
+            return 4;
+        case ColorFormat::eObject:
+            return 0;
+    }
+    return 16;
+}
+
+// IEEE 754 binary16, rounded to nearest even. Overflow goes to infinity, NaN stays NaN.
+uint16_t float_to_half(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7fffffff;
+
+    if(abs >= 0x7f800000) {
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    }
+    if(abs >= 0x477ff000) { // Rounds to above 65504
+        return sign | 0x7c00;
+    }
+    if(abs < 0x38800000) { // Subnormal half, or zero
+        float magnitude;
+        memcpy(&magnitude, &abs, sizeof(magnitude));
+        // Scaling by 2^24 puts the half's subnormal steps at integers, nearbyint rounds to even
+        return sign | static_cast<uint16_t>(std::nearbyint(magnitude * 16777216.0f));
+    }
+    uint32_t mantissa_round = ((abs >> 13) & 1) + 0xfff;
+    return sign | static_cast<uint16_t>((abs - 0x38000000 + mantissa_round) >> 13);
+}
+
+void pack_half4(const glm::vec4& p, uint16_t* out) {
+    out[0] = float_to_half(p.x);
+    out[1] = float_to_half(p.y);
+    out[2] = float_to_half(p.z);
+    out[3] = float_to_half(1.0f);
+}
+
+#ifdef VERTEX_FORMAT_X86
+__attribute__((target("f16c")))
+void pack_half4_f16c(const glm::vec4& p, uint16_t* out) {
+    __m128i h = _mm_cvtps_ph(_mm_setr_ps(p.x, p.y, p.z, 1.0f), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), h);
+}
+#endif
+
+uint16_t quantize16(float x) {
+    return static_cast<uint16_t>(std::lround(std::min(std::max(x, 0.0f), 1.0f) * 65535.0f));
+}
+
+uint32_t pack_unorm8(const glm::vec4& c) {
+    auto channel = [](float x) {
+        return static_cast<uint32_t>(std::lround(std::min(std::max(x, 0.0f), 1.0f) * 255.0f));
+    };
+    // R in the lowest byte, as R8G8B8A8_UNORM expects in memory
+    return channel(c.x) | channel(c.y) << 8 | channel(c.z) << 16 | channel(c.w) << 24;
+}
+
+void pack_vertices(VertexFormat format, const Vertex* in, size_t count, glm::vec3 origin, glm::vec3 extent, char* out) {
+    // The default format is Vertex as is
+    if(format == VertexFormat {}) {
+        memcpy(out, in, count * sizeof(Vertex));
+        return;
+    }
+
+    bool f16c = false;
+#ifdef VERTEX_FORMAT_X86
+    static const bool has_f16c = __builtin_cpu_supports("f16c");
+    f16c = has_f16c;
+#endif
+    glm::vec3 inverse_extent(
+        extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f
+    );
+    uint32_t stride = format.stride();
+    uint32_t color_offset = format.position_size();
+
+    // Each vertex is assembled in a local buffer and copied out whole, so mapped memory only sees sequential writes
+    for(size_t i = 0; i != count; ++i) {
+        alignas(16) char vertex[sizeof(Vertex)];
+        const glm::vec4& p = in[i].position;
+        switch(format.position) {
+            case PositionFormat::eFloat4:
+                memcpy(vertex, &p, 16);
+                break;
+            case PositionFormat::eFloat3:
+                memcpy(vertex, &p, 12);
+                break;
+            case PositionFormat::eHalf4: {
+                uint16_t half[4];
+#ifdef VERTEX_FORMAT_X86
+                if(f16c) {
+                    pack_half4_f16c(p, half);
+                } else {
+                    pack_half4(p, half);
+                }
+#else
+                pack_half4(p, half);
+#endif
+                memcpy(vertex, half, sizeof(half));
+                break;
+            }
+            case PositionFormat::eQuantized16: {
+                uint16_t q[4] = {
+                    quantize16((p.x - origin.x) * inverse_extent.x),
+                    quantize16((p.y - origin.y) * inverse_extent.y),
+                    quantize16((p.z - origin.z) * inverse_extent.z),
+                    0
+                };
+                memcpy(vertex, q, sizeof(q));
+                break;
+            }
+        }
+        switch(format.color) {
+            case ColorFormat::eFloat4:
+                memcpy(vertex + color_offset, &in[i].color, 16);
+                break;
+            case ColorFormat::eUnorm8: {
+                uint32_t c = pack_unorm8(in[i].color);
+                memcpy(vertex + color_offset, &c, sizeof(c));
+                break;
+            }
+            case ColorFormat::eObject:
+                break;
+        }
+        memcpy(out + i * stride, vertex, stride);
+    }
+    (void)f16c;
+}
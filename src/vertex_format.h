@@ -0,0 +1,45 @@
+#pragma once
+
+#include "vobject.h"
+#include <cstddef>
+#include <cstdint>
+
+enum class PositionFormat : uint8_t {
+    eFloat4,     // 16 bytes, as in Vertex
+    eFloat3,     // 12 bytes, w is always 1
+    eHalf4,      // 8 bytes, three component half formats are rarely supported for vertex input, so w pads it
+    eQuantized16 // 8 bytes, 16 bit unorm steps across the object's bounding box, plus padding
+};
+
+enum class ColorFormat : uint8_t {
+    eFloat4, // 16 bytes, as in Vertex
+    eUnorm8, // 4 bytes
+    eObject  // Not stored per vertex, the object's color applies to every vertex
+};
+
+// How vertices are laid out in the vertex buffer. The default is Vertex itself, 32 bytes;
+// eHalf4 or eQuantized16 with eObject colors take 8.
+struct VertexFormat {
+    PositionFormat position = PositionFormat::eFloat4;
+    ColorFormat color = ColorFormat::eFloat4;
+
+    uint32_t position_size() const;
+    uint32_t color_size() const;
+    uint32_t stride() const { return position_size() + color_size(); }
+    // Formats that need ObjectData in the vertex shader
+    bool uses_object_data() const { return position == PositionFormat::eQuantized16 || color == ColorFormat::eObject; }
+
+    bool operator==(const VertexFormat& other) const { return position == other.position && color == other.color; }
+    bool operator!=(const VertexFormat& other) const { return !(*this == other); }
+};
+
+// Per object parameters for unpacking its vertices, objects[gl_InstanceIndex] in test.vert
+struct ObjectData {
+    glm::vec4 color;  // Used by ColorFormat::eObject
+    glm::vec4 origin; // Corner of the box eQuantized16 positions are relative to
+    glm::vec4 extent; // Size of that box
+};
+
+// Converts count vertices into format, written front to back so out may be mapped memory.
+// origin and extent are only used for quantized positions, points outside the box are clamped to it.
+void pack_vertices(VertexFormat format, const Vertex* in, size_t count, glm::vec3 origin, glm::vec3 extent, char* out);
@@ -1,13 +1,172 @@
 #include "vobject.h"
+#include <algorithm>
+#include <cmath>
 
-VCurve::VCurve(std::vector<glm::vec3> points) {
+// Deep enough for a 65536 to 1 ratio between the longest and shortest span
+const uint32_t max_subdivision_depth = 16;
+// Parametric curves start from a few uniform spans, so features narrower than a whole span are not missed
+const uint32_t initial_parametric_spans = 8;
+// Surface vertices are evaluated in square tiles, big enough to amortize handing them out, small enough to balance
+const uint32_t surface_tile_size = 32;
+// Curve spans per job, enough that a job is not mostly scheduling overhead for cheap functions
+const uint32_t curve_spans_per_job = 16;
 
+float distance_to_segment(glm::vec3 p, glm::vec3 a, glm::vec3 b) {
+    glm::vec3 ab = b - a;
+    float length2 = glm::dot(ab, ab);
+    if(length2 == 0.0f) {
+        return glm::length(p - a);
+    }
+    float t = glm::clamp(glm::dot(p - a, ab) / length2, 0.0f, 1.0f);
+    return glm::length(p - (a + t * ab));
 }
 
-VCurve::VCurve(std::vector<float> x, std::vector<float> y, std::vector<float> z) {
+// Appends the end of the span [t0, t1], after as many interior points as it takes to stay within tolerance.
+// pm is the curve at the span's midpoint, carried over from the parent span so each level costs two evaluations.
+void subdivide(
+    const std::function<glm::vec3(float)>& f, float t0, glm::vec3 p0, float t1, glm::vec3 p1, glm::vec3 pm,
+    float tolerance, uint32_t depth, std::vector<glm::vec3>& out
+) {
+    float tm = 0.5f * (t0 + t1);
+    glm::vec3 q0 = f(0.5f * (t0 + tm));
+    glm::vec3 q1 = f(0.5f * (tm + t1));
 
+    // The quarter points catch S-shaped spans whose midpoint happens to lie on the chord
+    float error = std::max({
+        distance_to_segment(pm, p0, p1), distance_to_segment(q0, p0, p1), distance_to_segment(q1, p0, p1)
+    });
+    if(error <= tolerance || depth == max_subdivision_depth) {
+        out.push_back(p1);
+        return;
+    }
+
+    subdivide(f, t0, p0, tm, pm, q0, tolerance, depth + 1, out);
+    subdivide(f, tm, pm, t1, p1, q1, tolerance, depth + 1, out);
+}
+
+VCurve::VCurve(std::vector<glm::vec3> points, float tolerance, glm::vec4 color) {
+    position = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    if(points.size() < 2) {
+        for(auto& p : points) {
+            vertices.push_back({glm::vec4(p, 1.0f), color});
+        }
+        return;
+    }
+
+    // Uniform Catmull-Rom, segment i runs from points[i] to points[i + 1], end points are repeated
+    auto spline = [&points](float t) {
+        int last = static_cast<int>(points.size()) - 1;
+        int i = std::min(static_cast<int>(t), last - 1);
+        float u = t - i;
+        glm::vec3 p0 = points[std::max(i - 1, 0)];
+        glm::vec3 p1 = points[i];
+        glm::vec3 p2 = points[i + 1];
+        glm::vec3 p3 = points[std::min(i + 2, last)];
+        return 0.5f * (
+            2.0f * p1 +
+            (p2 - p0) * u +
+            (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * u * u +
+            (3.0f * p1 - p0 - 3.0f * p2 + p3) * u * u * u
+        );
+    };
+    tessellate(spline, 0.0f, static_cast<float>(points.size() - 1), points.size() - 1, tolerance, color);
+}
+
+VCurve::VCurve(std::vector<float> x, std::vector<float> y, std::vector<float> z, float tolerance, glm::vec4 color)
+    : VCurve([&x, &y, &z]() {
+        std::vector<glm::vec3> points(std::min({x.size(), y.size(), z.size()}));
+        for(size_t i = 0; i != points.size(); ++i) {
+            points[i] = glm::vec3(x[i], y[i], z[i]);
+        }
+        return points;
+    }(), tolerance, color) {}
+
+VCurve::VCurve(const std::function<glm::vec3(float)>& f, float t_begin, float t_end, float tolerance, glm::vec4 color) {
+    position = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    tessellate(f, t_begin, t_end, initial_parametric_spans, tolerance, color);
 }
 
 VCurve::~VCurve() {
     
 }
+
+// Spans are subdivided in parallel, each range of them into its own list, joined in order at the end
+void VCurve::tessellate(const std::function<glm::vec3(float)>& f, float t_begin, float t_end, uint32_t spans, float tolerance, glm::vec4 color) {
+    float step = (t_end - t_begin) / spans;
+    uint32_t range_count = (spans + curve_spans_per_job - 1) / curve_spans_per_job;
+    std::vector<std::vector<glm::vec3>> ranges(range_count);
+    JobSystem& jobs = job_system();
+    jobs.wait(jobs.parallel_for(0, spans, curve_spans_per_job, [&](size_t first, size_t last) {
+        std::vector<glm::vec3>& points = ranges[first / curve_spans_per_job];
+        glm::vec3 p0 = f(t_begin + first * step);
+        for(size_t i = first; i != last; ++i) {
+            float t0 = t_begin + i * step;
+            float t1 = (i + 1 == spans) ? t_end : t0 + step;
+            glm::vec3 p1 = f(t1);
+            subdivide(f, t0, p0, t1, p1, f(0.5f * (t0 + t1)), tolerance, 0, points);
+            p0 = p1;
+        }
+    }));
+
+    size_t total = 1;
+    for(auto& points : ranges) {
+        total += points.size();
+    }
+    vertices.reserve(total);
+    vertices.push_back({glm::vec4(f(t_begin), 1.0f), color});
+    for(auto& points : ranges) {
+        for(auto& p : points) {
+            vertices.push_back({glm::vec4(p, 1.0f), color});
+        }
+    }
+}
+
+VSurface::VSurface(const SurfaceFunction& f, uint32_t u_count, uint32_t v_count, glm::vec4 color)
+    : u_count(std::max(u_count, 2u)), v_count(std::max(v_count, 2u)), color(color) {
+    position = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    vertices.resize(size_t(this->u_count) * this->v_count);
+
+    // Two counter-clockwise triangles per quad, row by row so neighbouring triangles share cached vertices
+    indices.reserve(size_t(this->u_count - 1) * (this->v_count - 1) * 6);
+    for(uint32_t j = 0; j + 1 < this->v_count; ++j) {
+        for(uint32_t i = 0; i + 1 < this->u_count; ++i) {
+            uint32_t a = j * this->u_count + i;
+            uint32_t b = a + 1;
+            uint32_t c = a + this->u_count;
+            uint32_t d = c + 1;
+            indices.insert(indices.end(), {a, b, c, b, d, c});
+        }
+    }
+    tessellate(f);
+}
+
+void VSurface::tessellate(const SurfaceFunction& f) {
+    tessellate(f, job_system());
+}
+
+void VSurface::tessellate(const SurfaceFunction& f, JobSystem& jobs) {
+    const glm::vec3 light(0.0f, 0.0f, -1.0f);
+    uint32_t tiles_u = (u_count + surface_tile_size - 1) / surface_tile_size;
+    uint32_t tiles_v = (v_count + surface_tile_size - 1) / surface_tile_size;
+    uint32_t tile_count = tiles_u * tiles_v;
+
+    jobs.wait(jobs.parallel_for(0, tile_count, 1, [&](size_t first, size_t last) {
+        for(size_t tile = first; tile != last; ++tile) {
+            uint32_t i0 = (tile % tiles_u) * surface_tile_size;
+            uint32_t j0 = (tile / tiles_u) * surface_tile_size;
+            uint32_t i1 = std::min(i0 + surface_tile_size, u_count);
+            uint32_t j1 = std::min(j0 + surface_tile_size, v_count);
+            for(uint32_t j = j0; j != j1; ++j) {
+                float v = j / float(v_count - 1);
+                Vertex* row = vertices.data() + size_t(j) * u_count;
+                for(uint32_t i = i0; i != i1; ++i) {
+                    SurfaceSample s = f(i / float(u_count - 1), v);
+                    float length = glm::length(s.normal);
+                    // Both sides are drawn, so light them the same
+                    float lambert = length > 0.0f ? std::abs(glm::dot(s.normal, light)) / length : 1.0f;
+                    row[i] = {glm::vec4(s.position, 1.0f), glm::vec4(glm::vec3(color) * (0.2f + 0.8f * lambert), color.w)};
+                }
+            }
+        }
+    }));
+}
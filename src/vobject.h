@@ -1,7 +1,13 @@
 #pragma once
+#include <cstdint>
+#include <cstddef>
 #include <vector>
+#include <functional>
+#include "jobs.h"
 #include <glm/glm.hpp>
 
+// Largest distance, in object space units, a tessellated curve may deviate from the exact one
+const float default_curve_tolerance = 1e-3f;
 
 struct Vertex {
     glm::vec4 position;
@@ -14,9 +20,44 @@ public:
     glm::vec4 position;
 };
 
+// Line strip tessellated adaptively, spans are only split where the curve bends away from them by more than tolerance
 class VCurve : public VObject {
 public:
-    VCurve(std::vector<glm::vec3> points);
-    VCurve(std::vector<float> x, std::vector<float> y, std::vector<float> z);
+    // Catmull-Rom spline through the points
+    VCurve(std::vector<glm::vec3> points, float tolerance = default_curve_tolerance, glm::vec4 color = glm::vec4(1.0f));
+    // Large sample sets that need no smoothing are better passed to Render::add_samples, which skips the vertex copy
+    VCurve(std::vector<float> x, std::vector<float> y, std::vector<float> z, float tolerance = default_curve_tolerance, glm::vec4 color = glm::vec4(1.0f));
+    // f sampled over [t_begin, t_end], from several threads at once
+    VCurve(
+        const std::function<glm::vec3(float)>& f, float t_begin, float t_end,
+        float tolerance = default_curve_tolerance, glm::vec4 color = glm::vec4(1.0f)
+    );
     ~VCurve();
-};
\ No newline at end of file
+
+private:
+    void tessellate(const std::function<glm::vec3(float)>& f, float t_begin, float t_end, uint32_t spans, float tolerance, glm::vec4 color);
+};
+
+struct SurfaceSample {
+    glm::vec3 position;
+    glm::vec3 normal;
+};
+
+using SurfaceFunction = std::function<SurfaceSample(float u, float v)>;
+
+// Triangle grid over (u, v) in [0, 1]^2, sharing each vertex between the up to six triangles around it.
+// Vertex has no normal, so a fixed headlight is baked into the colors instead.
+class VSurface : public VObject {
+public:
+    // Grids up to 1024 x 1024 are fine, f is evaluated in parallel tiles and must be safe to call from several threads
+    VSurface(const SurfaceFunction& f, uint32_t u_count, uint32_t v_count, glm::vec4 color = glm::vec4(1.0f));
+
+    // Re-evaluates every vertex, the grid and so the indices stay the same
+    void tessellate(const SurfaceFunction& f);
+    void tessellate(const SurfaceFunction& f, JobSystem& jobs);
+
+    std::vector<uint32_t> indices;
+    uint32_t u_count;
+    uint32_t v_count;
+    glm::vec4 color;
+};
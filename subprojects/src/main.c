@@ -31,9 +31,12 @@ VkQueue queue;
 VkBuffer input_buffer;
 VkBuffer output_buffer;
 VkBuffer device_buffer;
-VkDeviceMemory input_buffer_memory;
-VkDeviceMemory output_buffer_memory;
-VkDeviceMemory device_buffer_memory;
+// All three buffers are suballocated from a single allocation
+VkDeviceMemory buffer_memory;
+VkDeviceSize input_buffer_offset;
+VkDeviceSize output_buffer_offset;
+VkDeviceSize device_buffer_offset;
+char *buffer_memory_ptr;
 VkShaderModule shader_module;
 VkDescriptorSetLayout descriptor_set_layout;
 VkPipelineLayout pipeline_layout;
@@ -177,98 +180,76 @@ void create_buffers() {
       "Could not create device buffer\n")
 }
 
-void allocate_memory() {
-  VkMemoryRequirements i_buffer_requirements;
-  vkGetBufferMemoryRequirements(device, input_buffer, &i_buffer_requirements);
-
+uint32_t find_memory_type(uint32_t type_bits, VkMemoryPropertyFlags flags) {
   VkPhysicalDeviceMemoryProperties memory_properties;
   vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
 
-  uint32_t input_mem_index = UINT32_MAX;
   for (uint32_t i = 0; i != memory_properties.memoryTypeCount; i++) {
-    const uint32_t bit_select = (1 << i);
-    if (bit_select & i_buffer_requirements.memoryTypeBits &&
-        memory_properties.memoryTypes[i].propertyFlags &
-            (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-             VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
-      input_mem_index = i;
-      break;
+    if ((type_bits & (1u << i)) &&
+        (memory_properties.memoryTypes[i].propertyFlags & flags) == flags) {
+      return i;
     }
   }
-  if (input_mem_index == UINT32_MAX) {
-    printf("Could not find appropriate memory index for input buffer\n");
-    exit(EXIT_FAILURE);
-  }
 
-  VkMemoryRequirements o_buffer_requirements;
-  vkGetBufferMemoryRequirements(device, output_buffer, &o_buffer_requirements);
+  return UINT32_MAX;
+}
 
-  uint32_t output_mem_index = UINT32_MAX;
-  for (uint32_t i = 0; i != memory_properties.memoryTypeCount; i++) {
-    const uint32_t bit_select = (1 << i);
-    if (bit_select & o_buffer_requirements.memoryTypeBits &&
-        memory_properties.memoryTypes[i].propertyFlags &
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT &&
-        memory_properties.memoryTypes[i].propertyFlags &
-            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
-      output_mem_index = i;
-      break;
-    }
-  }
-  if (output_mem_index == UINT32_MAX) {
-    printf("Could not find appropriate memory for output buffer\n");
-    exit(EXIT_FAILURE);
-  }
+VkDeviceSize align_offset(VkDeviceSize offset, VkDeviceSize alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
 
+void allocate_memory() {
+  VkMemoryRequirements i_buffer_requirements;
+  vkGetBufferMemoryRequirements(device, input_buffer, &i_buffer_requirements);
+  VkMemoryRequirements o_buffer_requirements;
+  vkGetBufferMemoryRequirements(device, output_buffer, &o_buffer_requirements);
   VkMemoryRequirements d_buffer_requirements;
   vkGetBufferMemoryRequirements(device, device_buffer, &d_buffer_requirements);
 
-  uint32_t device_mem_index = UINT32_MAX;
-  for (uint32_t i = 0; i != memory_properties.memoryTypeCount; i++) {
-    const uint32_t bit_select = (1 << i);
-    if (bit_select & d_buffer_requirements.memoryTypeBits &&
-        memory_properties.memoryTypes[i].propertyFlags &
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT &&
-        memory_properties.memoryTypes[i].propertyFlags &
-            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
-      device_mem_index = i;
-      break;
-    }
-  }
-  if (device_mem_index == UINT32_MAX) {
-    printf("Could not find appropriate memory for device buffer\n");
+  uint32_t mem_index =
+      find_memory_type(i_buffer_requirements.memoryTypeBits &
+                           o_buffer_requirements.memoryTypeBits &
+                           d_buffer_requirements.memoryTypeBits,
+                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  if (mem_index == UINT32_MAX) {
+    printf("Could not find appropriate memory index for buffers\n");
     exit(EXIT_FAILURE);
   }
 
-  VkMemoryAllocateInfo i_buffer_info = {};
-  i_buffer_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  i_buffer_info.memoryTypeIndex = input_mem_index;
-  i_buffer_info.allocationSize = i_buffer_requirements.size;
-  ERR(vkAllocateMemory(device, &i_buffer_info, NULL, &input_buffer_memory),
-      "Could not allocate memory for input buffer\n")
-
-  VkMemoryAllocateInfo o_buffer_info = {};
-  o_buffer_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  o_buffer_info.memoryTypeIndex = output_mem_index;
-  o_buffer_info.allocationSize = o_buffer_requirements.size;
-  ERR(vkAllocateMemory(device, &o_buffer_info, NULL, &output_buffer_memory),
-      "Could not allocate memory for output buffer\n")
-
-  VkMemoryAllocateInfo d_buffer_info = {};
-  d_buffer_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  d_buffer_info.memoryTypeIndex = device_mem_index;
-  d_buffer_info.allocationSize = d_buffer_requirements.size;
-  ERR(vkAllocateMemory(device, &d_buffer_info, NULL, &device_buffer_memory),
-      "Could not allocate memory for device buffer\n")
+  input_buffer_offset = 0;
+  output_buffer_offset =
+      align_offset(input_buffer_offset + i_buffer_requirements.size,
+                   o_buffer_requirements.alignment);
+  device_buffer_offset =
+      align_offset(output_buffer_offset + o_buffer_requirements.size,
+                   d_buffer_requirements.alignment);
+
+  VkMemoryAllocateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  buffer_info.memoryTypeIndex = mem_index;
+  buffer_info.allocationSize =
+      device_buffer_offset + d_buffer_requirements.size;
+  ERR(vkAllocateMemory(device, &buffer_info, NULL, &buffer_memory),
+      "Could not allocate memory for buffers\n")
 }
 
 void bind_memory() {
-  ERR(vkBindBufferMemory(device, input_buffer, input_buffer_memory, 0),
+  ERR(vkBindBufferMemory(device, input_buffer, buffer_memory,
+                         input_buffer_offset),
       "Could not bind memory for input buffer\n")
-  ERR(vkBindBufferMemory(device, output_buffer, output_buffer_memory, 0),
+  ERR(vkBindBufferMemory(device, output_buffer, buffer_memory,
+                         output_buffer_offset),
       "Could not bind memory for output buffer\n")
-  ERR(vkBindBufferMemory(device, device_buffer, device_buffer_memory, 0),
+  ERR(vkBindBufferMemory(device, device_buffer, buffer_memory,
+                         device_buffer_offset),
       "Could not bind memory for device buffer\n")
+
+  // Memory can only be mapped once, keep it mapped for both input and output
+  void *ptr;
+  ERR(vkMapMemory(device, buffer_memory, 0, VK_WHOLE_SIZE, 0, &ptr),
+      "Could not map buffer memory\n")
+  buffer_memory_ptr = (char *)ptr;
 }
 
 void create_shader_module() {
@@ -443,21 +424,14 @@ void record_commands() {
 }
 
 void fill_input_buffer() {
-  void *input_ptr;
-  vkMapMemory(device, input_buffer_memory, 0, VK_WHOLE_SIZE, 0, &input_ptr);
-
-  uint32_t *data = (uint32_t *)input_ptr;
+  uint32_t *data = (uint32_t *)(buffer_memory_ptr + input_buffer_offset);
   for (uint32_t i = 0; i != NUM_ELEMENTS; ++i) {
     data[i] = 42;
   }
 }
 
 void print_output_buffer() {
-  void *output_pointer;
-  vkMapMemory(device, output_buffer_memory, 0, VK_WHOLE_SIZE, 0,
-              &output_pointer);
-
-  uint32_t *data = (uint32_t *)output_pointer;
+  uint32_t *data = (uint32_t *)(buffer_memory_ptr + output_buffer_offset);
   for (uint32_t i = 0; i != NUM_ELEMENTS; ++i) {
     printf("%d ", data[i]);
   }
@@ -490,9 +464,7 @@ void cleanup() {
   vkDestroyShaderModule(device, shader_module, NULL);
   vkDestroyPipelineLayout(device, pipeline_layout, NULL);
   vkDestroyPipeline(device, compute_pipeline, NULL);
-  vkFreeMemory(device, input_buffer_memory, NULL);
-  vkFreeMemory(device, output_buffer_memory, NULL);
-  vkFreeMemory(device, device_buffer_memory, NULL);
+  vkFreeMemory(device, buffer_memory, NULL);
   vkDestroyBuffer(device, input_buffer, NULL);
   vkDestroyBuffer(device, output_buffer, NULL);
   vkDestroyBuffer(device, device_buffer, NULL);